@@ -0,0 +1,211 @@
+#ifndef _BUFFER_ARENA_
+#define _BUFFER_ARENA_
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+const uint64_t kHugePageSize = 2 * 1024 * 1024;
+
+// one mapping backed by 2MB pages that connection buffers are carved from, so thousands
+// of them share a few TLB entries and Buffer::Expand does not fault in the request path.
+// MAP_HUGETLB needs pages reserved in vm.nr_hugepages, without them the mapping falls
+// back to transparent huge pages through madvise. Every page is touched in Open(), and
+// locked when asked, before the first client arrives. Blocks are handed out in power of
+// two size classes from 64 bytes up and freed ones are kept per class, so a buffer grown
+// to any size reuses what a buffer of a similar size left. Requests the arena cannot fit
+// come from the heap.
+class BufferArena
+{
+public:
+    struct Stats
+    {
+        uint64_t reserved;      // bytes mapped
+        uint64_t huge_bytes;    // of those, backed by huge pages right now
+        bool hugetlb;           // MAP_HUGETLB, otherwise transparent huge pages
+        bool locked;
+        uint64_t in_use;        // bytes handed out
+        uint64_t allocs;
+        uint64_t fallbacks;     // allocations that went to the heap
+    };
+
+    BufferArena() : base_(nullptr), size_(0), top_(0), in_use_(0), allocs_(0), fallbacks_(0), hugetlb_(false), locked_(false) {}
+
+    ~BufferArena()
+    {
+        if (base_)
+        {
+            munmap(base_, size_);
+        }
+    }
+
+    // bytes are rounded up to whole huge pages, false with errno set when nothing could be mapped.
+    // Call on the thread the buffers are used on, the pages are first touched here
+    bool Open(uint64_t bytes, bool lock)
+    {
+        std::lock_guard<std::mutex> _(lock_);
+        if (base_)
+        {
+            return true;
+        }
+        size_ = (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+        void* p = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (p != MAP_FAILED)
+        {
+            hugetlb_ = true;
+        }
+        else
+        {
+            // over-map to put the arena on a huge page boundary, THP only backs aligned 2MB ranges
+            uint64_t len = size_ + kHugePageSize;
+            char* raw = (char*)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw == MAP_FAILED)
+            {
+                size_ = 0;
+                return false;
+            }
+            char* aligned = (char*)(((uintptr_t)raw + kHugePageSize - 1) & ~(kHugePageSize - 1));
+            if (aligned > raw)
+                munmap(raw, aligned - raw);
+            if (raw + len > aligned + size_)
+                munmap(aligned + size_, raw + len - (aligned + size_));
+            p = aligned;
+            madvise(p, size_, MADV_HUGEPAGE);
+        }
+        base_ = (char*)p;
+        // fault everything in now rather than on the first recv into it
+        for (uint64_t off = 0; off < size_; off += 4096)
+        {
+            base_[off] = 0;
+        }
+        if (lock)
+        {
+            locked_ = mlock(base_, size_) == 0;
+            if (!locked_)
+                perror("arena mlock");
+        }
+        return true;
+    }
+
+    char* Alloc(uint64_t bytes)
+    {
+        int cls = Class(bytes);
+        uint64_t len = 1ULL << cls;
+        std::lock_guard<std::mutex> _(lock_);
+        allocs_++;
+        if (!free_[cls].empty())
+        {
+            char* p = free_[cls].back();
+            free_[cls].pop_back();
+            in_use_ += len;
+            return p;
+        }
+        if (!base_ || size_ - top_ < len)
+        {
+            fallbacks_++;
+            return new char[bytes];
+        }
+        char* p = base_ + top_;
+        top_ += len;
+        in_use_ += len;
+        return p;
+    }
+
+    // bytes as passed to Alloc()
+    void Free(char* p, uint64_t bytes)
+    {
+        if (!p)
+        {
+            return;
+        }
+        if (p < base_ || p >= base_ + size_)
+        {
+            delete[] p;
+            return;
+        }
+        int cls = Class(bytes);
+        std::lock_guard<std::mutex> _(lock_);
+        in_use_ -= 1ULL << cls;
+        free_[cls].push_back(p);
+    }
+
+    void GetStats(Stats& stats)
+    {
+        char* base;
+        {
+            std::lock_guard<std::mutex> _(lock_);
+            stats.in_use = in_use_;
+            stats.allocs = allocs_;
+            stats.fallbacks = fallbacks_;
+            stats.reserved = size_;
+            stats.hugetlb = hugetlb_;
+            stats.locked = locked_;
+            base = base_;
+        }
+        stats.huge_bytes = stats.hugetlb ? stats.reserved : AnonHugeBytes(base, stats.reserved);
+    }
+
+private:
+    static const int kMinClass = 6;     // 64 bytes, two buffers never share a cache line
+    static const int kClasses = 64;
+
+    // log2 of the power of two bytes are rounded up to
+    static inline int Class(uint64_t bytes)
+    {
+        if (bytes <= (1ULL << kMinClass))
+        {
+            return kMinClass;
+        }
+        return 64 - __builtin_clzll(bytes - 1);
+    }
+
+    // AnonHugePages of our mapping in /proc/self/smaps
+    static uint64_t AnonHugeBytes(char* base, uint64_t size)
+    {
+        if (!base)
+        {
+            return 0;
+        }
+        FILE* fp = fopen("/proc/self/smaps", "r");
+        if (!fp)
+        {
+            return 0;
+        }
+        char line[512];
+        bool ours = false;
+        uint64_t kb = 0;
+        while (fgets(line, sizeof(line), fp))
+        {
+            unsigned long start, end;
+            if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+            {
+                // a range the kernel split off still lies inside the arena
+                ours = start >= (uintptr_t)base && end <= (uintptr_t)(base + size);
+                continue;
+            }
+            unsigned long n;
+            if (ours && sscanf(line, "AnonHugePages: %lu kB", &n) == 1)
+            {
+                kb += n;
+            }
+        }
+        fclose(fp);
+        return kb * 1024;
+    }
+
+    char* base_;
+    uint64_t size_;
+    uint64_t top_;
+    uint64_t in_use_;
+    uint64_t allocs_;
+    uint64_t fallbacks_;
+    bool hugetlb_;
+    bool locked_;
+    std::mutex lock_;
+    std::vector<char*> free_[kClasses];
+};
+
+#endif // _BUFFER_ARENA_
@@ -0,0 +1,120 @@
+#include "poll_server_coro.h"
+#include <unistd.h>
+#include <map>
+#include <condition_variable>
+
+// stands in for a downstream call or disk read: resumes the awaiting coroutine from
+// its own thread once the delay passed
+class DelayQueue
+{
+public:
+    struct Awaiter
+    {
+        DelayQueue& queue;
+        uint64_t due;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            queue.Add(due, handle);
+        }
+
+        void await_resume() {}
+    };
+
+    DelayQueue() : running_(true), thread_(&DelayQueue::Loop, this) {}
+
+    ~DelayQueue()
+    {
+        {
+            std::lock_guard<std::mutex> _(lock_);
+            running_ = false;
+            cv_.notify_one();
+        }
+        thread_.join();
+    }
+
+    Awaiter Sleep(uint32_t us)
+    {
+        return Awaiter{*this, NowUs() + us};
+    }
+
+private:
+    static uint64_t NowUs()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+    }
+
+    void Add(uint64_t due, std::coroutine_handle<> handle)
+    {
+        std::lock_guard<std::mutex> _(lock_);
+        due_.insert(std::make_pair(due, handle));
+        cv_.notify_one();
+    }
+
+    void Loop()
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        while (running_)
+        {
+            if (due_.empty())
+            {
+                cv_.wait(lock);
+                continue;
+            }
+            uint64_t now = NowUs();
+            if (due_.begin()->first > now)
+            {
+                cv_.wait_for(lock, std::chrono::microseconds(due_.begin()->first - now));
+                continue;
+            }
+            std::coroutine_handle<> handle = due_.begin()->second;
+            due_.erase(due_.begin());
+            lock.unlock();
+            handle.resume();
+            lock.lock();
+        }
+    }
+
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::multimap<uint64_t, std::coroutine_handle<>> due_;
+    bool running_;
+    std::thread thread_;
+};
+
+DelayQueue g_delay;
+uint32_t g_delay_us = 1000;
+
+// echoes the request after an I/O-like wait that does not hold up the loop
+ServerTask do_sponse(std::string request)
+{
+    co_await g_delay.Sleep(g_delay_us);
+    UDSockServer::Responder self = co_await ThisRequest();
+    if (self.Cancelled())
+    {
+        co_return std::string();
+    }
+    co_return request;
+}
+
+// usage: coro_ser [delay us], every request of method 0 waits that long before its echo
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    g_delay_us = argc > 1 ? atoi(argv[1]) : 1000;
+    UDSockServer server;
+    if (!server.Init(kServerAddress, nullptr) || !RegisterCoroMethod(server, 0, &do_sponse))
+    {
+        perror("init");
+        return 1;
+    }
+    server.Run();
+    return 0;
+}
@@ -0,0 +1,224 @@
+#ifndef _CRC32C_
+#define _CRC32C_
+#include <stdint.h>
+#include <stddef.h>
+#include <cstring>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// CRC32C (Castagnoli), the polynomial SSE4.2 has an instruction for. Crc32c() picks the
+// instruction when the CPU has it and slicing-by-8 tables otherwise, both give the same
+// value. Pass the previous result as crc to checksum data in pieces.
+class Crc32cImpl
+{
+    static const uint32_t kPoly = 0x82f63b78;
+
+public:
+    static uint32_t Soft(const void* data, size_t size, uint32_t crc)
+    {
+        const Tables& t = Table();
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+        crc = ~crc;
+        while (size >= 8)
+        {
+            uint32_t lo, hi;
+            memcpy(&lo, p, 4);
+            memcpy(&hi, p + 4, 4);
+            lo ^= crc;
+            crc = t.v[7][lo & 0xff] ^ t.v[6][(lo >> 8) & 0xff] ^ t.v[5][(lo >> 16) & 0xff] ^ t.v[4][lo >> 24] ^
+                t.v[3][hi & 0xff] ^ t.v[2][(hi >> 8) & 0xff] ^ t.v[1][(hi >> 16) & 0xff] ^ t.v[0][hi >> 24];
+            p += 8;
+            size -= 8;
+        }
+        while (size--)
+        {
+            crc = t.v[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+#if defined(__x86_64__)
+    // three independent streams keep the crc32 unit busy, its latency is three times its
+    // throughput, and the partial results are joined by shifting them over the zeros
+    // that follow them (zeros tables built at first use)
+    __attribute__((target("sse4.2")))
+    static uint32_t Hard(const void* data, size_t size, uint32_t crc)
+    {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+        uint64_t c0 = ~crc;
+        while (size >= 3 * kLong)
+        {
+            c0 = Interleave(p, kLong, c0, Zeros().lng);
+            p += 3 * kLong;
+            size -= 3 * kLong;
+        }
+        while (size >= 3 * kShort)
+        {
+            c0 = Interleave(p, kShort, c0, Zeros().shrt);
+            p += 3 * kShort;
+            size -= 3 * kShort;
+        }
+        while (size >= 8)
+        {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            c0 = _mm_crc32_u64(c0, v);
+            p += 8;
+            size -= 8;
+        }
+        uint32_t c32 = c0;
+        while (size--)
+        {
+            c32 = _mm_crc32_u8(c32, *p++);
+        }
+        return ~c32;
+    }
+
+    static bool HasHard()
+    {
+        static const bool has = __builtin_cpu_supports("sse4.2");
+        return has;
+    }
+#else
+    static uint32_t Hard(const void* data, size_t size, uint32_t crc)
+    {
+        return Soft(data, size, crc);
+    }
+
+    static bool HasHard()
+    {
+        return false;
+    }
+#endif
+
+private:
+#if defined(__x86_64__)
+    static const size_t kLong = 8192;
+    static const size_t kShort = 256;
+
+    typedef uint32_t ZeroTable[4][256];
+
+    struct ZeroTables
+    {
+        ZeroTable lng;
+        ZeroTable shrt;
+
+        ZeroTables()
+        {
+            Build(lng, kLong);
+            Build(shrt, kShort);
+        }
+    };
+
+    static const ZeroTables& Zeros()
+    {
+        static const ZeroTables zeros;
+        return zeros;
+    }
+
+    __attribute__((target("sse4.2")))
+    static inline uint64_t Interleave(const uint8_t* p, size_t len, uint64_t c0, const ZeroTable& zeros)
+    {
+        uint64_t c1 = 0, c2 = 0;
+        for (const uint8_t* end = p + len; p < end; p += 8)
+        {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p, 8);
+            memcpy(&v1, p + len, 8);
+            memcpy(&v2, p + 2 * len, 8);
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        c0 = Shift(zeros, c0) ^ c1;
+        return Shift(zeros, c0) ^ c2;
+    }
+
+    static inline uint32_t Shift(const ZeroTable& zeros, uint32_t crc)
+    {
+        return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+    }
+
+    static uint32_t MatrixTimes(const uint32_t* mat, uint32_t vec)
+    {
+        uint32_t sum = 0;
+        for (; vec; vec >>= 1, mat++)
+        {
+            if (vec & 1)
+                sum ^= *mat;
+        }
+        return sum;
+    }
+
+    static void MatrixSquare(uint32_t* square, const uint32_t* mat)
+    {
+        for (int n = 0; n < 32; n++)
+            square[n] = MatrixTimes(mat, mat[n]);
+    }
+
+    // table applying the operator for appending len zero bytes to a crc
+    static void Build(ZeroTable& zeros, size_t len)
+    {
+        uint32_t even[32], odd[32];
+        odd[0] = kPoly;
+        for (int n = 1; n < 32; n++)
+            odd[n] = 1u << (n - 1);
+        MatrixSquare(even, odd);    // two zero bits
+        MatrixSquare(odd, even);    // four
+        uint32_t* op = odd;
+        do
+        {
+            MatrixSquare(even, odd);
+            op = even;
+            len >>= 1;
+            if (!len)
+                break;
+            MatrixSquare(odd, even);
+            op = odd;
+            len >>= 1;
+        } while (len);
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            zeros[0][n] = MatrixTimes(op, n);
+            zeros[1][n] = MatrixTimes(op, n << 8);
+            zeros[2][n] = MatrixTimes(op, n << 16);
+            zeros[3][n] = MatrixTimes(op, n << 24);
+        }
+    }
+#endif
+
+    struct Tables
+    {
+        uint32_t v[8][256];
+
+        Tables()
+        {
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t crc = i;
+                for (int k = 0; k < 8; k++)
+                    crc = (crc >> 1) ^ (kPoly & (0 - (crc & 1)));
+                v[0][i] = crc;
+            }
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                for (int k = 1; k < 8; k++)
+                    v[k][i] = (v[k - 1][i] >> 8) ^ v[0][v[k - 1][i] & 0xff];
+            }
+        }
+    };
+
+    static const Tables& Table()
+    {
+        static const Tables tables;
+        return tables;
+    }
+};
+
+inline uint32_t Crc32c(const void* data, size_t size, uint32_t crc = 0)
+{
+    return Crc32cImpl::HasHard() ? Crc32cImpl::Hard(data, size, crc) : Crc32cImpl::Soft(data, size, crc);
+}
+
+#endif // _CRC32C_
@@ -0,0 +1,353 @@
+#ifndef _EVENT_BACKEND_
+#define _EVENT_BACKEND_
+#include <sys/epoll.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+
+// readiness reported by a backend, events is a mix of the flags below
+struct BackendEvent
+{
+    void* ptr;
+    uint32_t events;
+};
+
+const uint32_t kEventIn = 0x1;
+const uint32_t kEventErr = 0x2;    // error or hang-up, kEventIn may be set as well
+const uint32_t kEventOut = 0x4;    // writable again, only while output is watched
+
+// what a registered fd is to the loop, only backends that treat them differently look at it
+enum WatchKind
+{
+    kWatchListen,
+    kWatchConn,
+    kWatchNotify,   // eventfd or timer owned by the loop
+};
+
+// Event backends are policies for UDSockServer::Serve<Backend>(), every call is resolved
+// at compile time. They provide:
+//   bool Open()                                 false with errno set
+//   void Close()
+//   bool Add(int fd, void* ptr, WatchKind kind) watch fd for input, ptr comes back in events
+//   void Remove(int fd)
+//   bool WatchOutput(int fd, void* ptr, bool on)  also report kEventOut for a watched fd
+//   int Wait(BackendEvent* events, int max, int timeout_ms)
+//   bool Accepting()                            false while it cannot take another connection
+//   static const char* Name()
+
+class EpollBackend
+{
+public:
+    EpollBackend() : efd_(-1) {}
+
+    ~EpollBackend()
+    {
+        Close();
+    }
+
+    static const char* Name()
+    {
+        return "epoll";
+    }
+
+    bool Open()
+    {
+        efd_ = epoll_create1(EPOLL_CLOEXEC);
+        return efd_ != -1;
+    }
+
+    void Close()
+    {
+        if (efd_ != -1)
+        {
+            close(efd_);
+            efd_ = -1;
+        }
+    }
+
+    inline bool Add(int fd, void* ptr, WatchKind)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = ptr;
+        return epoll_ctl(efd_, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+
+    inline void Remove(int fd)
+    {
+        epoll_ctl(efd_, EPOLL_CTL_DEL, fd, NULL);
+    }
+
+    inline bool WatchOutput(int fd, void* ptr, bool on)
+    {
+        struct epoll_event ev;
+        ev.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        ev.data.ptr = ptr;
+        return epoll_ctl(efd_, EPOLL_CTL_MOD, fd, &ev) == 0;
+    }
+
+    inline bool Accepting()
+    {
+        return true;
+    }
+
+    inline int Wait(BackendEvent* events, int max, int timeout_ms)
+    {
+        struct epoll_event ready[kBatch];
+        int cnt = epoll_wait(efd_, ready, max < kBatch ? max : kBatch, timeout_ms);
+        for (int i = 0; i < cnt; i++)
+        {
+            events[i].ptr = ready[i].data.ptr;
+            events[i].events = ((ready[i].events & EPOLLIN) ? kEventIn : 0) |
+                ((ready[i].events & EPOLLOUT) ? kEventOut : 0) |
+                ((ready[i].events & (EPOLLERR | EPOLLHUP)) ? kEventErr : 0);
+        }
+        return cnt;
+    }
+
+private:
+    static const int kBatch = 1024;
+    int efd_;
+};
+
+// for hosts without epoll: a dense pollfd array, Remove moves the last entry into the hole
+// so every poll() only covers live fds
+class PollBackend
+{
+public:
+    static const char* Name()
+    {
+        return "poll";
+    }
+
+    bool Open()
+    {
+        return true;
+    }
+
+    void Close()
+    {
+        fds_.clear();
+        ptrs_.clear();
+        index_.clear();
+    }
+
+    inline bool Add(int fd, void* ptr, WatchKind)
+    {
+        if (index_.count(fd))
+        {
+            errno = EEXIST;
+            return false;
+        }
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        index_[fd] = fds_.size();
+        fds_.push_back(pfd);
+        ptrs_.push_back(ptr);
+        return true;
+    }
+
+    inline void Remove(int fd)
+    {
+        auto it = index_.find(fd);
+        if (it == index_.end())
+        {
+            return;
+        }
+        size_t pos = it->second;
+        index_.erase(it);
+        if (pos != fds_.size() - 1)
+        {
+            fds_[pos] = fds_.back();
+            ptrs_[pos] = ptrs_.back();
+            index_[fds_[pos].fd] = pos;
+        }
+        fds_.pop_back();
+        ptrs_.pop_back();
+    }
+
+    inline bool WatchOutput(int fd, void*, bool on)
+    {
+        auto it = index_.find(fd);
+        if (it == index_.end())
+        {
+            errno = ENOENT;
+            return false;
+        }
+        fds_[it->second].events = on ? POLLIN | POLLOUT : POLLIN;
+        return true;
+    }
+
+    inline bool Accepting()
+    {
+        return true;
+    }
+
+    inline int Wait(BackendEvent* events, int max, int timeout_ms)
+    {
+        int nready = poll(fds_.data(), fds_.size(), timeout_ms);
+        int cnt = 0;
+        for (size_t i = 0; i < fds_.size() && cnt < nready && cnt < max; i++)
+        {
+            short revents = fds_[i].revents;
+            if (!revents)
+            {
+                continue;
+            }
+            events[cnt].ptr = ptrs_[i];
+            events[cnt].events = ((revents & POLLIN) ? kEventIn : 0) |
+                ((revents & POLLOUT) ? kEventOut : 0) |
+                ((revents & (POLLERR | POLLHUP | POLLNVAL)) ? kEventErr : 0);
+            cnt++;
+        }
+        return nready < 0 ? nready : cnt;
+    }
+
+private:
+    std::vector<struct pollfd> fds_;
+    std::vector<void*> ptrs_;
+    std::unordered_map<int, size_t> index_;
+};
+
+// one client at a time, like the server in single/: while a connection is attached the
+// listener is not watched and later clients wait in the listen backlog
+class BlockingBackend
+{
+public:
+    BlockingBackend() : listen_fd_(-1), listen_ptr_(nullptr), conn_fd_(-1), conn_ptr_(nullptr), conn_out_(false) {}
+
+    static const char* Name()
+    {
+        return "blocking";
+    }
+
+    bool Open()
+    {
+        return true;
+    }
+
+    void Close()
+    {
+        listen_fd_ = conn_fd_ = -1;
+        notify_.clear();
+    }
+
+    inline bool Add(int fd, void* ptr, WatchKind kind)
+    {
+        switch (kind)
+        {
+        case kWatchListen:
+            listen_fd_ = fd;
+            listen_ptr_ = ptr;
+            return true;
+        case kWatchConn:
+            if (conn_fd_ != -1)
+            {
+                errno = EBUSY;
+                return false;
+            }
+            conn_fd_ = fd;
+            conn_ptr_ = ptr;
+            conn_out_ = false;
+            return true;
+        default:
+            notify_.push_back(std::make_pair(fd, ptr));
+            return true;
+        }
+    }
+
+    inline void Remove(int fd)
+    {
+        if (fd == conn_fd_)
+        {
+            conn_fd_ = -1;
+        }
+        else if (fd == listen_fd_)
+        {
+            listen_fd_ = -1;
+        }
+        for (size_t i = 0; i < notify_.size(); i++)
+        {
+            if (notify_[i].first == fd)
+            {
+                notify_.erase(notify_.begin() + i);
+                break;
+            }
+        }
+    }
+
+    inline bool WatchOutput(int fd, void*, bool on)
+    {
+        if (fd != conn_fd_)
+        {
+            errno = ENOENT;
+            return false;
+        }
+        conn_out_ = on;
+        return true;
+    }
+
+    inline bool Accepting()
+    {
+        return conn_fd_ == -1;
+    }
+
+    inline int Wait(BackendEvent* events, int max, int timeout_ms)
+    {
+        struct pollfd fds[kMaxNotify + 1];
+        void* ptrs[kMaxNotify + 1];
+        int n = 0;
+        int fd = conn_fd_ != -1 ? conn_fd_ : listen_fd_;
+        if (fd != -1)
+        {
+            fds[n].fd = fd;
+            ptrs[n++] = conn_fd_ != -1 ? conn_ptr_ : listen_ptr_;
+        }
+        for (size_t i = 0; i < notify_.size() && n <= kMaxNotify; i++)
+        {
+            fds[n].fd = notify_[i].first;
+            ptrs[n++] = notify_[i].second;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (conn_fd_ != -1 && conn_out_)
+        {
+            fds[0].events |= POLLOUT;
+        }
+
+        int nready = poll(fds, n, timeout_ms);
+        int cnt = 0;
+        for (int i = 0; i < n && cnt < nready && cnt < max; i++)
+        {
+            if (!fds[i].revents)
+            {
+                continue;
+            }
+            events[cnt].ptr = ptrs[i];
+            events[cnt].events = ((fds[i].revents & POLLIN) ? kEventIn : 0) |
+                ((fds[i].revents & POLLOUT) ? kEventOut : 0) |
+                ((fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) ? kEventErr : 0);
+            cnt++;
+        }
+        return nready < 0 ? nready : cnt;
+    }
+
+private:
+    static const int kMaxNotify = 4;
+    int listen_fd_;
+    void* listen_ptr_;
+    int conn_fd_;
+    void* conn_ptr_;
+    bool conn_out_;
+    std::vector<std::pair<int, void*>> notify_;
+};
+
+#endif // _EVENT_BACKEND_
@@ -0,0 +1,99 @@
+#include "flight_recorder.h"
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+
+struct Row
+{
+    uint32_t tid;
+    FlightEvent ev;
+};
+
+static void Describe(const FlightEvent& ev, char* out, size_t size)
+{
+    switch (ev.type)
+    {
+    case kFlightAccept:     snprintf(out, size, "accept pid=%lu", ev.a); break;
+    case kFlightRead:       snprintf(out, size, "read bytes=%lu", ev.a); break;
+    case kFlightFrames:     snprintf(out, size, "frames count=%lu", ev.a); break;
+    case kFlightHandler:    snprintf(out, size, "handler method=%lu ns=%lu", ev.a, ev.b); break;
+    case kFlightWrite:      snprintf(out, size, "write bytes=%lu", ev.a); break;
+    case kFlightWriteAgain: snprintf(out, size, "write-eagain retries=%lu", ev.a); break;
+    case kFlightWriteError: snprintf(out, size, "write-error %s", strerror(ev.a)); break;
+    case kFlightRecvError:  snprintf(out, size, "recv-error %s", strerror(ev.a)); break;
+    case kFlightClose:      snprintf(out, size, "close events=0x%lx", ev.a); break;
+    case kFlightConnect:    snprintf(out, size, "connect"); break;
+    case kFlightDisconnect: snprintf(out, size, "disconnect pending=%lu", ev.a); break;
+    case kFlightTimeout:    snprintf(out, size, "timeout requests=%lu", ev.a); break;
+    case kFlightHandOver:   snprintf(out, size, "hand-over conns=%lu drain_us=%lu", ev.a, ev.b); break;
+    case kFlightBadFrame:   snprintf(out, size, "bad-frame size=%lu %s", ev.a, ev.b ? "crc-mismatch" : "too-large"); break;
+    case kFlightOutBlocked: snprintf(out, size, "out-blocked queued=%lu", ev.a); break;
+    case kFlightOutOverflow: snprintf(out, size, "out-overflow queued=%lu", ev.a); break;
+    default:                snprintf(out, size, "type=%u a=%lu b=%lu", ev.type, ev.a, ev.b); break;
+    }
+}
+
+// usage: flight_decode <dump>, prints the events of every thread merged in time order
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <dump>\n", argv[0]);
+        return 1;
+    }
+    FILE* fp = fopen(argv[1], "rb");
+    if (!fp)
+    {
+        perror("open");
+        return 1;
+    }
+
+    FlightDumpHdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, "UDSFLT02", 8) != 0 || hdr.event_size != sizeof(FlightEvent))
+    {
+        fprintf(stderr, "%s: not a flight recorder dump\n", argv[1]);
+        fclose(fp);
+        return 1;
+    }
+
+    if (hdr.dropped)
+    {
+        printf("%lu events dropped, more than %d threads were recording\n", hdr.dropped, kFlightMaxRings);
+    }
+    std::vector<Row> rows;
+    for (uint32_t i = 0; i < hdr.rings; i++)
+    {
+        FlightRingHdr rhdr;
+        if (fread(&rhdr, sizeof(rhdr), 1, fp) != 1)
+        {
+            fprintf(stderr, "truncated dump\n");
+            break;
+        }
+        printf("thread %u: %u events of %lu recorded\n", rhdr.tid, rhdr.count, rhdr.head);
+        for (uint32_t j = 0; j < rhdr.count; j++)
+        {
+            Row row;
+            row.tid = rhdr.tid;
+            if (fread(&row.ev, sizeof(row.ev), 1, fp) != 1)
+                break;
+            rows.push_back(row);
+        }
+    }
+    fclose(fp);
+
+    std::stable_sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) { return a.ev.ns < b.ev.ns; });
+    for (auto& row : rows)
+    {
+        // monotonic to wall clock through the pair of readings taken at dump time
+        uint64_t real = hdr.real_ns - (hdr.mono_ns - row.ev.ns);
+        time_t sec = real / 1000000000ULL;
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        char when[32], what[128];
+        strftime(when, sizeof(when), "%H:%M:%S", &tm);
+        Describe(row.ev, what, sizeof(what));
+        printf("%s.%06lu tid=%u fd=%d %s\n", when, (unsigned long)((real % 1000000000ULL) / 1000), row.tid, row.ev.fd, what);
+    }
+    return 0;
+}
@@ -0,0 +1,309 @@
+#ifndef _FLIGHT_RECORDER_
+#define _FLIGHT_RECORDER_
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <cstring>
+#include <atomic>
+
+// what the loops record, a and b depend on the type
+enum FlightType : uint16_t
+{
+    kFlightAccept = 1,      // fd: new connection, a: peer pid
+    kFlightRead,            // a: bytes received
+    kFlightFrames,          // a: frames served from one read
+    kFlightHandler,         // a: method, b: handler ns
+    kFlightWrite,           // a: bytes written
+    kFlightWriteAgain,      // a: EAGAIN retries before the write completed
+    kFlightWriteError,      // a: errno
+    kFlightRecvError,       // a: errno
+    kFlightClose,           // a: poll/epoll events that closed it
+    kFlightConnect,         // client connected
+    kFlightDisconnect,      // a: pending requests failed
+    kFlightTimeout,         // a: requests expired in one tick
+    kFlightHandOver,        // a: connections passed to the new process, b: drain us
+    kFlightBadFrame,        // a: data_size, b: 1 when the CRC did not match, 0 when too large
+    kFlightOutBlocked,      // a: bytes left queued until the socket is writable
+    kFlightOutOverflow,     // a: bytes queued when the connection was dropped
+};
+
+struct FlightEvent
+{
+    uint64_t ns;            // CLOCK_MONOTONIC
+    uint16_t type;
+    uint16_t pad;
+    int32_t fd;
+    uint64_t a;
+    uint64_t b;
+};
+
+const uint32_t kFlightEvents = 4096;    // per thread, power of two
+const int kFlightMaxRings = 64;         // threads recording at the same time
+
+// single writer ring owned by one thread, readers copy it without stopping the writer.
+// Returned when its thread exits and reused by the next thread that records
+struct FlightRing
+{
+    std::atomic<uint64_t> head;
+    std::atomic<bool> used;     // owned by a live thread
+    uint32_t tid;
+    FlightEvent events[kFlightEvents];
+};
+
+// dump layout: FlightDumpHdr, then per ring FlightRingHdr and count events oldest first
+struct FlightDumpHdr
+{
+    char magic[8];          // "UDSFLT02"
+    uint32_t rings;
+    uint32_t event_size;
+    uint64_t mono_ns;       // both clocks at dump time, to put wall time on events
+    uint64_t real_ns;
+    uint64_t dropped;       // events of threads that found no free ring
+};
+
+struct FlightRingHdr
+{
+    uint32_t tid;
+    uint32_t count;
+    uint64_t head;
+};
+
+// always-on per-thread event rings. Record() is a few stores and a clock read, no lock
+// and no allocation after the first event of a thread. A thread's ring is kept for the
+// dump after it exits until another thread takes it over, at most kFlightMaxRings are
+// ever allocated. Dump() only uses write(2) so it can run in a signal handler; events
+// written meanwhile may come out torn.
+class FlightRecorder
+{
+public:
+    static inline void Record(uint16_t type, int fd, uint64_t a, uint64_t b = 0)
+    {
+        FlightRing* ring = Local().ring;
+        if (!ring && !(ring = Attach()))
+        {
+            Dropped().fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        FlightEvent& ev = ring->events[head & (kFlightEvents - 1)];
+        ev.ns = NowNs();
+        ev.type = type;
+        ev.fd = fd;
+        ev.a = a;
+        ev.b = b;
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+
+    // events lost while more than kFlightMaxRings threads were recording
+    static uint64_t DroppedEvents()
+    {
+        return Dropped().load(std::memory_order_relaxed);
+    }
+
+    static int Dump(int fd)
+    {
+        // rings are installed in slot order
+        int rings = 0;
+        while (rings < kFlightMaxRings && Rings()[rings].load(std::memory_order_acquire))
+        {
+            rings++;
+        }
+
+        FlightDumpHdr hdr;
+        memcpy(hdr.magic, "UDSFLT02", 8);
+        hdr.rings = rings;
+        hdr.dropped = Dropped().load(std::memory_order_relaxed);
+        hdr.event_size = sizeof(FlightEvent);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        hdr.mono_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+        clock_gettime(CLOCK_REALTIME, &now);
+        hdr.real_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+        if (!WriteAll(fd, &hdr, sizeof(hdr)))
+        {
+            return -1;
+        }
+
+        for (int i = 0; i < rings; i++)
+        {
+            FlightRing* ring = Rings()[i].load(std::memory_order_acquire);
+            FlightRingHdr rhdr;
+            rhdr.tid = ring->tid;
+            rhdr.head = ring->head.load(std::memory_order_acquire);
+            rhdr.count = rhdr.head < kFlightEvents ? rhdr.head : kFlightEvents;
+            if (!WriteAll(fd, &rhdr, sizeof(rhdr)))
+            {
+                return -1;
+            }
+            if (!rhdr.count)
+            {
+                continue;
+            }
+            // oldest first: from the slot after head to the end, then from the start
+            uint32_t start = (rhdr.head - rhdr.count) & (kFlightEvents - 1);
+            uint32_t first = kFlightEvents - start < rhdr.count ? kFlightEvents - start : rhdr.count;
+            if (!WriteAll(fd, &ring->events[start], first * sizeof(FlightEvent)) ||
+                !WriteAll(fd, &ring->events[0], (rhdr.count - first) * sizeof(FlightEvent)))
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    static int Dump(const char* path)
+    {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1)
+        {
+            return -1;
+        }
+        int ret = Dump(fd);
+        close(fd);
+        return ret;
+    }
+
+    // dump to path whenever sig arrives, e.g. kill -USR2 <pid>
+    static bool InstallSignal(int sig, const char* path)
+    {
+        if (strlen(path) >= sizeof(DumpPath()))
+        {
+            return false;
+        }
+        strcpy(DumpPath(), path);
+        struct sigaction act;
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = &FlightRecorder::OnSignal;
+        act.sa_flags = SA_RESTART;
+        sigemptyset(&act.sa_mask);
+        return sigaction(sig, &act, NULL) == 0;
+    }
+
+private:
+    static inline uint64_t NowNs()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000000000ULL + now.tv_nsec;
+    }
+
+    // plain thread_local, the hot path reads it without an init guard
+    struct LocalState
+    {
+        FlightRing* ring;
+        uint32_t misses;    // Attach() calls that found every ring taken
+        bool exited;
+    };
+
+    static inline LocalState& Local()
+    {
+        static thread_local LocalState local = {nullptr, 0, false};
+        return local;
+    }
+
+    // returns the ring when its thread exits
+    struct Owner
+    {
+        ~Owner()
+        {
+            LocalState& local = Local();
+            local.ring->used.store(false, std::memory_order_release);
+            local.ring = nullptr;
+            local.exited = true;
+        }
+    };
+
+    // take a free ring, or install a new one in the first empty slot. A thread that
+    // found none tries again every 1024 events, not on each
+    static FlightRing* Attach()
+    {
+        LocalState& local = Local();
+        if (local.exited || (local.misses++ & 1023))
+        {
+            return nullptr;
+        }
+        FlightRing* ring = nullptr;
+        for (int i = 0; i < kFlightMaxRings && !ring; i++)
+        {
+            FlightRing* cur = Rings()[i].load(std::memory_order_acquire);
+            if (!cur)
+            {
+                FlightRing* fresh = new FlightRing();
+                fresh->head = 0;
+                fresh->used = true;
+                if (Rings()[i].compare_exchange_strong(cur, fresh, std::memory_order_acq_rel))
+                {
+                    ring = fresh;
+                    break;
+                }
+                // another thread installed it first, cur is now its ring
+                delete fresh;
+            }
+            bool used = false;
+            if (cur->used.compare_exchange_strong(used, true, std::memory_order_acq_rel))
+            {
+                // the events of the thread that exited give way to the new one
+                cur->head.store(0, std::memory_order_relaxed);
+                ring = cur;
+            }
+        }
+        if (!ring)
+        {
+            return nullptr;
+        }
+        ring->tid = syscall(SYS_gettid);
+        static thread_local Owner owner;
+        (void)owner;
+        local.ring = ring;
+        local.misses = 0;
+        return ring;
+    }
+
+    static void OnSignal(int)
+    {
+        int saved = errno;
+        Dump(DumpPath());
+        errno = saved;
+    }
+
+    static bool WriteAll(int fd, const void* data, size_t size)
+    {
+        const char* p = reinterpret_cast<const char*>(data);
+        while (size > 0)
+        {
+            ssize_t n = write(fd, p, size);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static std::atomic<uint64_t>& Dropped()
+    {
+        static std::atomic<uint64_t> dropped(0);
+        return dropped;
+    }
+
+    static std::atomic<FlightRing*>* Rings()
+    {
+        static std::atomic<FlightRing*> rings[kFlightMaxRings];
+        return rings;
+    }
+
+    typedef char PathBuf[256];
+    static PathBuf& DumpPath()
+    {
+        static PathBuf path = "/tmp/uds_flight.bin";
+        return path;
+    }
+};
+
+#endif // _FLIGHT_RECORDER_
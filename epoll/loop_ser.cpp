@@ -1,4 +1,5 @@
 #include "poll_server.h"
+#include "perf_counter.h"
 #include <unistd.h>
 
 std::string do_sponse(char* data, uint64_t size)
@@ -6,15 +7,41 @@ std::string do_sponse(char* data, uint64_t size)
     return std::string(data, size);
 }
 
-int main()
+// usage: loop_ser [--profile], with --profile the per request costs are printed on Ctrl-C,
+// kill -USR2 writes the flight recorder to /tmp/uds_flight.bin, read it with flight_decode
+int main(int argc, char** argv)
 {
     signal(SIGPIPE, SIG_IGN);
+    FlightRecorder::InstallSignal(SIGUSR2, "/tmp/uds_flight.bin");
+    bool profile = argc > 1 && std::string(argv[1]) == "--profile";
     UDSockServer server;
     if (!server.Init(kServerAddress, std::bind(&do_sponse, std::placeholders::_1, std::placeholders::_2)))
     {
         perror("init");
         return 1;
     }
-    server.Run();
+    if (!profile)
+    {
+        server.Run();
+        return 0;
+    }
+
+#ifndef UDS_PROFILE
+    std::cout << "built without -DUDS_PROFILE, phases are not recorded" << std::endl;
+#endif
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    std::thread loop(&UDSockServer::Run, &server);
+    int sig;
+    sigwait(&set, &sig);
+    server.Stop();
+    loop.join();
+
+    UDSockServer::MethodStats stats;
+    server.GetMethodStats(0, stats);
+    PerfProfile::Report(std::cout, "server", stats.calls);
     return 0;
 }
\ No newline at end of file
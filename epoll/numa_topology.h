@@ -0,0 +1,183 @@
+#ifndef _NUMA_TOPOLOGY_
+#define _NUMA_TOPOLOGY_
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// NUMA nodes from /sys/devices/system/node without libnuma. Memory is placed by the
+// kernel's first-touch policy: a thread bound to a node gets its heap pages from that
+// node as long as it is the first to write them, so the loop allocating and filling its
+// own buffers is enough to keep them local. Hosts without the sysfs tree are one node.
+class NumaTopology
+{
+public:
+    static const NumaTopology& Get()
+    {
+        static NumaTopology topology;
+        return topology;
+    }
+
+    // nodes that have CPUs, numbered as the kernel does
+    const std::vector<int>& Nodes() const
+    {
+        return nodes_;
+    }
+
+    // -1 for an unknown cpu
+    int NodeOfCpu(int cpu) const
+    {
+        return cpu >= 0 && cpu < (int)cpu_node_.size() ? cpu_node_[cpu] : -1;
+    }
+
+    bool CpusOfNode(int node, cpu_set_t& cpus) const
+    {
+        CPU_ZERO(&cpus);
+        bool any = false;
+        for (size_t cpu = 0; cpu < cpu_node_.size() && cpu < CPU_SETSIZE; cpu++)
+        {
+            if (cpu_node_[cpu] == node)
+            {
+                CPU_SET(cpu, &cpus);
+                any = true;
+            }
+        }
+        return any;
+    }
+
+    // keep the calling thread on the CPUs of node
+    bool BindThread(int node) const
+    {
+        cpu_set_t cpus;
+        if (!CpusOfNode(node, cpus))
+        {
+            return false;
+        }
+        return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+    }
+
+    // node a process runs on: the one its affinity mask is confined to, otherwise
+    // the node of the CPU it last ran on, -1 when it cannot be told
+    int NodeOfPid(pid_t pid) const
+    {
+        cpu_set_t cpus;
+        if (pid > 0 && sched_getaffinity(pid, sizeof(cpus), &cpus) == 0)
+        {
+            int node = -1;
+            for (size_t cpu = 0; cpu < cpu_node_.size() && cpu < CPU_SETSIZE; cpu++)
+            {
+                if (!CPU_ISSET(cpu, &cpus))
+                    continue;
+                if (node != -1 && node != cpu_node_[cpu])
+                {
+                    node = -1;
+                    break;
+                }
+                node = cpu_node_[cpu];
+            }
+            if (node != -1)
+            {
+                return node;
+            }
+        }
+        return NodeOfCpu(LastCpu(pid));
+    }
+
+private:
+    NumaTopology()
+    {
+        DIR* dir = opendir("/sys/devices/system/node");
+        struct dirent* ent;
+        while (dir && (ent = readdir(dir)) != NULL)
+        {
+            int node;
+            char tail;
+            if (sscanf(ent->d_name, "node%d%c", &node, &tail) != 1)
+                continue;
+            std::string path = std::string("/sys/devices/system/node/") + ent->d_name + "/cpulist";
+            if (ReadCpuList(path.c_str(), node))
+                nodes_.push_back(node);
+        }
+        if (dir)
+            closedir(dir);
+
+        if (nodes_.empty())
+        {
+            long cpus = sysconf(_SC_NPROCESSORS_CONF);
+            cpu_node_.assign(cpus > 0 ? cpus : 1, 0);
+            nodes_.push_back(0);
+        }
+        std::sort(nodes_.begin(), nodes_.end());
+    }
+
+    // "0-3,8-11", false when the node has no CPUs
+    bool ReadCpuList(const char* path, int node)
+    {
+        FILE* fp = fopen(path, "r");
+        if (!fp)
+        {
+            return false;
+        }
+        char line[4096];
+        bool any = false;
+        if (fgets(line, sizeof(line), fp))
+        {
+            char* p = line;
+            while (*p >= '0' && *p <= '9')
+            {
+                int first = strtol(p, &p, 10);
+                int last = first;
+                if (*p == '-')
+                    last = strtol(p + 1, &p, 10);
+                for (int cpu = first; cpu <= last; cpu++)
+                {
+                    if (cpu >= (int)cpu_node_.size())
+                        cpu_node_.resize(cpu + 1, -1);
+                    cpu_node_[cpu] = node;
+                    any = true;
+                }
+                if (*p == ',')
+                    p++;
+            }
+        }
+        fclose(fp);
+        return any;
+    }
+
+    // field 39 of /proc/<pid>/stat, counted after the parenthesised command name
+    static int LastCpu(pid_t pid)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+        FILE* fp = fopen(path, "r");
+        if (!fp)
+        {
+            return -1;
+        }
+        char line[1024];
+        int cpu = -1;
+        if (fgets(line, sizeof(line), fp))
+        {
+            char* p = strrchr(line, ')');
+            for (int field = 2; p && field < 39; field++)
+            {
+                p = strchr(p + 1, ' ');
+            }
+            if (p)
+                cpu = atoi(p + 1);
+        }
+        fclose(fp);
+        return cpu;
+    }
+
+    std::vector<int> nodes_;
+    std::vector<int> cpu_node_;     // cpu -> node
+};
+
+#endif // _NUMA_TOPOLOGY_
@@ -0,0 +1,269 @@
+#ifndef _PERF_COUNTER_
+#define _PERF_COUNTER_
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <cstring>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+enum PerfEvent
+{
+    kPerfCycles,
+    kPerfInstructions,
+    kPerfCacheMisses,
+    kPerfCtxSwitches,
+    kPerfSyscalls,
+    kPerfTaskClock,     // cpu time in ns, a software counter so it works without a PMU
+    kPerfEvents,
+};
+
+// every moment of a profiled thread is attributed to exactly one phase
+enum PerfPhase
+{
+    kPhaseEpoll,    // blocked in or returning from epoll_wait
+    kPhaseParse,    // recv and frame parsing
+    kPhaseHandler,  // server handler or client callback
+    kPhaseWrite,    // writev/send of a frame
+    kPhaseOther,    // bookkeeping and caller code
+    kPhases,
+};
+
+// counters of the calling thread only, nothing system wide, so no privileges are needed
+// beyond perf_event_paranoid <= 2. Counters the kernel or the machine does not offer
+// (no PMU in most VMs, no tracefs for syscalls) are reported as unavailable.
+class PerfCounters
+{
+public:
+    PerfCounters() : leader_(-1), opened_(0)
+    {
+        for (int i = 0; i < kPerfEvents; i++)
+        {
+            fds_[i] = -1;
+            slot_[i] = -1;
+        }
+        Open(kPerfCycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        Open(kPerfInstructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        Open(kPerfCacheMisses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        Open(kPerfCtxSwitches, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+        int64_t id = SyscallTracepoint();
+        if (id >= 0)
+        {
+            Open(kPerfSyscalls, PERF_TYPE_TRACEPOINT, id);
+        }
+        Open(kPerfTaskClock, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
+        if (leader_ != -1)
+        {
+            ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    ~PerfCounters()
+    {
+        for (int i = 0; i < kPerfEvents; i++)
+        {
+            if (fds_[i] != -1)
+                close(fds_[i]);
+        }
+    }
+
+    bool Available(int event)
+    {
+        return fds_[event] != -1;
+    }
+
+    // one read() for the whole group, unavailable counters read 0
+    void Read(uint64_t* values)
+    {
+        uint64_t buf[1 + kPerfEvents];
+        memset(values, 0, sizeof(uint64_t) * kPerfEvents);
+        if (leader_ == -1 || read(leader_, buf, sizeof(uint64_t) * (1 + opened_)) <= 0)
+        {
+            return;
+        }
+        for (int i = 0; i < kPerfEvents; i++)
+        {
+            if (slot_[i] >= 0)
+                values[i] = buf[1 + slot_[i]];
+        }
+    }
+
+private:
+    void Open(int event, uint32_t type, uint64_t config)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = leader_ == -1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader_, 0);
+        if (fd == -1 && type != PERF_TYPE_TRACEPOINT)
+        {
+            // user space only when perf_event_paranoid forbids kernel counting
+            attr.exclude_kernel = 1;
+            fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader_, 0);
+        }
+        if (fd == -1)
+        {
+            return;
+        }
+        if (leader_ == -1)
+        {
+            leader_ = fd;
+        }
+        fds_[event] = fd;
+        slot_[event] = opened_++;
+    }
+
+    static int64_t SyscallTracepoint()
+    {
+        const char* paths[] = {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+            "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+        for (auto path : paths)
+        {
+            FILE* fp = fopen(path, "r");
+            if (!fp)
+                continue;
+            long long id = -1;
+            if (fscanf(fp, "%lld", &id) != 1)
+                id = -1;
+            fclose(fp);
+            if (id >= 0)
+                return id;
+        }
+        return -1;
+    }
+
+    int fds_[kPerfEvents];
+    int slot_[kPerfEvents];     // position in the group read
+    int leader_;
+    int opened_;
+};
+
+// per-thread phase accounting, Switch() charges everything since the previous switch
+// to the phase that was current. Each switch costs one read() of the counter group.
+class PerfProfile
+{
+public:
+    static PerfProfile& Local()
+    {
+        static thread_local PerfProfile* local = nullptr;
+        if (!local)
+        {
+            std::shared_ptr<PerfProfile> profile(new PerfProfile());
+            std::lock_guard<std::mutex> _(RegistryLock());
+            Registry().push_back(profile);
+            local = profile.get();
+        }
+        return *local;
+    }
+
+    void Switch(int phase)
+    {
+        uint64_t now[kPerfEvents];
+        counters_.Read(now);
+        for (int i = 0; i < kPerfEvents; i++)
+        {
+            uint64_t delta = now[i] - last_[i];
+            // the read() that took this sample is not part of the phase
+            if (i == kPerfSyscalls && delta)
+                delta--;
+            acc_[current_][i].fetch_add(delta, std::memory_order_relaxed);
+            last_[i] = now[i];
+        }
+        current_ = phase;
+    }
+
+    // totals over every thread that switched phases, divided by requests
+    static void Report(std::ostream& os, const std::string& who, uint64_t requests)
+    {
+        static const char* phase_names[kPhases] = {"epoll_wait", "parse", "handler", "write", "other"};
+        static const char* event_names[kPerfEvents] = {"cycles", "instructions", "cache-misses", "ctx-switches", "syscalls", "cpu-ns"};
+        double sum[kPhases][kPerfEvents] = {};
+        bool available[kPerfEvents] = {};
+        {
+            std::lock_guard<std::mutex> _(RegistryLock());
+            for (auto& profile : Registry())
+            {
+                for (int e = 0; e < kPerfEvents; e++)
+                {
+                    available[e] |= profile->counters_.Available(e);
+                    for (int p = 0; p < kPhases; p++)
+                        sum[p][e] += profile->acc_[p][e].load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        requests = requests ? requests : 1;
+        os << "[" << who << "] per request over " << requests << " requests" << std::endl;
+        os << std::left << std::setw(12) << "phase";
+        for (int e = 0; e < kPerfEvents; e++)
+            os << std::right << std::setw(14) << event_names[e];
+        os << std::endl;
+
+        double total[kPerfEvents] = {};
+        for (int p = 0; p <= kPhases; p++)
+        {
+            os << std::left << std::setw(12) << (p < kPhases ? phase_names[p] : "total");
+            for (int e = 0; e < kPerfEvents; e++)
+            {
+                double value = p < kPhases ? sum[p][e] / requests : total[e];
+                if (p < kPhases)
+                    total[e] += value;
+                if (available[e])
+                    os << std::right << std::setw(14) << std::fixed << std::setprecision(3) << value;
+                else
+                    os << std::right << std::setw(14) << "n/a";
+            }
+            os << std::endl;
+        }
+    }
+
+private:
+    PerfProfile() : current_(kPhaseOther)
+    {
+        counters_.Read(last_);
+        for (int p = 0; p < kPhases; p++)
+            for (int e = 0; e < kPerfEvents; e++)
+                acc_[p][e] = 0;
+    }
+
+    static std::mutex& RegistryLock()
+    {
+        static std::mutex lock;
+        return lock;
+    }
+
+    // profiles outlive their threads so the report still sees exited receive threads
+    static std::vector<std::shared_ptr<PerfProfile>>& Registry()
+    {
+        static std::vector<std::shared_ptr<PerfProfile>> registry;
+        return registry;
+    }
+
+    PerfCounters counters_;
+    uint64_t last_[kPerfEvents];
+    int current_;
+    std::atomic<uint64_t> acc_[kPhases][kPerfEvents];
+};
+
+// phase boundaries compile to nothing unless built with -DUDS_PROFILE
+#ifdef UDS_PROFILE
+#define PERF_PHASE(phase) PerfProfile::Local().Switch(phase)
+#else
+#define PERF_PHASE(phase) do {} while (0)
+#endif
+
+#endif // _PERF_COUNTER_
@@ -0,0 +1,638 @@
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+#include "poll_balancer.h"
+
+const uint32_t kEjectMinMs = 100;
+const uint32_t kEjectMaxMs = 5000;
+const int kMonitorIntervalUs = 50000;
+const size_t kMaxEndpoints = 64;
+const uint64_t kHedgeTickUs = 100;
+const uint64_t kHedgeMinSamples = 64;
+const int kHedgeDecayRounds = 20;   // monitor rounds between halving the latency history
+
+// log2 bucket with 2 more bits of precision, about 25% wide
+static inline int LatencyBucket(uint64_t us)
+{
+    if (us < 4)
+    {
+        return us;
+    }
+    int bits = 63 - __builtin_clzll(us);
+    return bits * 4 + ((us >> (bits - 2)) & 3);
+}
+
+static inline uint64_t BucketLimit(int bucket)
+{
+    if (bucket < 4)
+    {
+        return bucket + 1;
+    }
+    return (5ULL + bucket % 4) << (bucket / 4 - 2);
+}
+
+UDSockBalancer::UDSockBalancer(const int& buffer_size) 
+    : buffer_size_(buffer_size), running_(false), hedge_percentile_(0), hedge_budget_(0), hedge_delay_(0), 
+    budget_requests_(0), budget_hedges_(0), hedges_(0), hedge_wins_(0), hedge_rounds_(0), next_key_(0)
+{
+    for (auto& cnt : latency_hist_)
+    {
+        cnt = 0;
+    }
+    hedge_wheel_.Reset(NowTick());
+}
+
+UDSockBalancer::~UDSockBalancer()
+{
+    Stop();
+}
+
+uint64_t UDSockBalancer::NowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+uint64_t UDSockBalancer::NowTick()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000ULL + now.tv_nsec / 1000) / kHedgeTickUs;
+}
+
+bool UDSockBalancer::Init(const std::vector<std::string>& server_addrs, const OnDisconnct& on_disconn)
+{
+    on_disconn_ = on_disconn;
+    if (server_addrs.empty() || server_addrs.size() > kMaxEndpoints)
+    {
+        LOG_OUT("invalid endpoint count", std::to_string(server_addrs.size()));
+        return false;
+    }
+
+    for (auto& path : server_addrs)
+    {
+        endpoints_.push_back(std::unique_ptr<Endpoint>(new Endpoint(path)));
+    }
+
+    size_t connected = 0;
+    for (auto& ep : endpoints_)
+    {
+        if (Connect(*ep))
+            connected++;
+        else
+            Eject(*ep);
+    }
+
+    running_ = true;
+    thread_ = std::thread(&UDSockBalancer::Monitor, this);
+    hedge_thread_ = std::thread(&UDSockBalancer::HedgeLoop, this);
+    return connected > 0;
+}
+
+bool UDSockBalancer::Connect(Endpoint& ep)
+{
+    std::shared_ptr<UDSockClient> client(new UDSockClient(buffer_size_));
+    if (!client->Init(ep.path, on_disconn_))
+    {
+        return false;
+    }
+    std::atomic_store(&ep.client, client);
+    ep.backoff_ms = 0;
+    ep.healthy = true;
+    return true;
+}
+
+// called on the send path, the monitor logs the ejection
+void UDSockBalancer::Eject(Endpoint& ep)
+{
+    if (ep.healthy.exchange(false))
+    {
+        ep.retry_at_ms = NowMs() + (ep.backoff_ms ? ep.backoff_ms : kEjectMinMs);
+    }
+}
+
+inline uint64_t UDSockBalancer::Score(Endpoint& ep, UDSockClient* client)
+{
+    // expected wait: queue length times observed latency, +1 so idle endpoints still rank by latency
+    return (client->InFlight() + 1) * (ep.latency_ns.load(std::memory_order_relaxed) + 1);
+}
+
+int UDSockBalancer::Pick(int exclude)
+{
+    static thread_local uint64_t seed = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+    int n = endpoints_.size();
+    int healthy[kMaxEndpoints];
+    int cnt = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (i != exclude && endpoints_[i]->healthy.load(std::memory_order_relaxed))
+            healthy[cnt++] = i;
+    }
+    if (cnt == 0)
+    {
+        return -1;
+    }
+    if (cnt == 1)
+    {
+        return healthy[0];
+    }
+
+    // xorshift, two distinct random candidates
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    int i = seed % cnt;
+    int a = healthy[i];
+    int b = healthy[(i + 1 + (seed >> 32) % (cnt - 1)) % cnt];
+
+    std::shared_ptr<UDSockClient> ca = std::atomic_load(&endpoints_[a]->client);
+    std::shared_ptr<UDSockClient> cb = std::atomic_load(&endpoints_[b]->client);
+    if (!ca || !cb)
+    {
+        return ca ? a : b;
+    }
+    return Score(*endpoints_[a], ca.get()) <= Score(*endpoints_[b], cb.get()) ? a : b;
+}
+
+int UDSockBalancer::SendRequest(std::string& request, const ResponseCbk& result_cbk)
+{
+    return SendRequest(0, request, result_cbk);
+}
+
+static inline uint64_t ElapsedNs(const struct timespec& begin)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - begin.tv_sec) * 1000000000ULL + end.tv_nsec - begin.tv_nsec;
+}
+
+inline void UDSockBalancer::RecordLatency(Endpoint& ep, const struct timespec& begin)
+{
+    uint64_t cost = ElapsedNs(begin);
+    uint64_t avg = ep.latency_ns.load(std::memory_order_relaxed);
+    ep.latency_ns.store(avg ? avg - avg / 8 + cost / 8 : cost, std::memory_order_relaxed);
+}
+
+// request ids: the client's id times the endpoint count plus the endpoint, shifted left
+// by one, or the key of a hedged request shifted left with the low bit set
+int UDSockBalancer::SendRequest(uint16_t method, std::string& request, const ResponseCbk& result_cbk,
+    const ErrorCbk& on_error, uint64_t* req_id)
+{
+    if (hedge_percentile_.load(std::memory_order_relaxed))
+    {
+        return SendHedged(method, request, result_cbk, on_error, req_id);
+    }
+
+    int ret = -ENOTCONN;
+    for (size_t attempt = 0; attempt < endpoints_.size(); attempt++)
+    {
+        int idx = Pick();
+        if (idx < 0)
+        {
+            break;
+        }
+        Endpoint* ep = endpoints_[idx].get();
+        std::shared_ptr<UDSockClient> client = std::atomic_load(&ep->client);
+        if (!client || !client->IsConnected())
+        {
+            Eject(*ep);
+            continue;
+        }
+
+        struct timespec begin;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        uint64_t id = 0;
+        ret = client->SendRequest(method, request, [this, ep, begin, result_cbk](char* data, uint64_t size) {
+            RecordLatency(*ep, begin);
+            result_cbk(data, size);
+        }, on_error, req_id ? &id : nullptr);
+        if (ret == 0)
+        {
+            if (req_id)
+            {
+                *req_id = (id * endpoints_.size() + idx) << 1;
+            }
+            return 0;
+        }
+        Eject(*ep);
+    }
+    return ret;
+}
+
+int UDSockBalancer::Cancel(uint64_t req_id)
+{
+    if (!(req_id & 1))
+    {
+        req_id >>= 1;
+        size_t n = endpoints_.size();
+        std::shared_ptr<UDSockClient> client = n ? std::atomic_load(&endpoints_[req_id % n]->client) : nullptr;
+        return client ? client->Cancel(req_id / n) : -ENOENT;
+    }
+
+    std::shared_ptr<Hedge> hedge;
+    {
+        std::lock_guard<std::mutex> _(lock_hedge_);
+        auto it = hedged_.find(req_id >> 1);
+        if (it == hedged_.end())
+        {
+            return -ENOENT;
+        }
+        hedge = it->second;
+    }
+    if (hedge->done.exchange(true))
+    {
+        return -ENOENT;
+    }
+    FinishHedge(hedge.get());
+    // their own error callbacks find the request done
+    for (int copy = 0; copy < 2; copy++)
+    {
+        uint64_t id = hedge->id[copy].load();
+        if (id)
+        {
+            hedge->client[copy]->Cancel(id);
+        }
+    }
+    if (hedge->err_cbk)
+    {
+        hedge->err_cbk(-ECANCELED);
+    }
+    return 0;
+}
+
+int UDSockBalancer::SendHedged(uint16_t method, std::string& request, const ResponseCbk& result_cbk,
+    const ErrorCbk& on_error, uint64_t* req_id)
+{
+    std::shared_ptr<Hedge> hedge(new Hedge());
+    hedge->method = method;
+    hedge->request = request;
+    hedge->cbk = result_cbk;
+    hedge->err_cbk = on_error;
+    clock_gettime(CLOCK_MONOTONIC, &hedge->begin);
+    if (req_id)
+    {
+        // known before the first copy is written, it may complete right away
+        hedge->key = next_key_.fetch_add(1, std::memory_order_relaxed) + 1;
+        std::lock_guard<std::mutex> _(lock_hedge_);
+        hedged_[hedge->key] = hedge;
+    }
+
+    int ret = -ENOTCONN;
+    for (size_t attempt = 0; attempt < endpoints_.size(); attempt++)
+    {
+        int idx = Pick();
+        if (idx < 0 || (ret = SendCopy(idx, hedge, 0)) == 0)
+        {
+            break;
+        }
+    }
+    if (ret != 0)
+    {
+        FinishHedge(hedge.get());
+        return ret;
+    }
+    if (req_id)
+    {
+        *req_id = (hedge->key << 1) | 1;
+    }
+
+    budget_requests_.fetch_add(1, std::memory_order_relaxed);
+    uint64_t delay = hedge_delay_.load(std::memory_order_relaxed);
+    if (delay == 0 || endpoints_.size() < 2)
+    {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> _(lock_hedge_);
+    if (hedge->done)
+    {
+        return 0;
+    }
+    bool idle = hedge_wheel_.Size() == 0;
+    hedge->self = hedge;
+    hedge->timer.data = (uint64_t)(uintptr_t)hedge.get();
+    hedge_wheel_.Add(&hedge->timer, NowTick() + delay);
+    if (idle)
+    {
+        hedge_cv_.notify_one();
+    }
+    return 0;
+}
+
+int UDSockBalancer::SendCopy(int idx, const std::shared_ptr<Hedge>& hedge, int copy)
+{
+    Endpoint* ep = endpoints_[idx].get();
+    std::shared_ptr<UDSockClient> client = std::atomic_load(&ep->client);
+    if (!client || !client->IsConnected())
+    {
+        Eject(*ep);
+        return -ENOTCONN;
+    }
+    hedge->endpoint[copy] = idx;
+    hedge->client[copy] = client;
+    {
+        std::lock_guard<std::mutex> _(hedge->lock);
+        hedge->live++;
+    }
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    uint64_t id = 0;
+    int ret = client->SendRequest(hedge->method, hedge->request, [this, ep, begin, hedge, copy](char* data, uint64_t size) {
+        RecordLatency(*ep, begin);
+        if (hedge->done.exchange(true))
+        {
+            // the other copy answered first
+            return;
+        }
+        FinishHedge(hedge.get());
+        // the delay is a percentile of whole requests, a cancelled copy never reports its own latency
+        latency_hist_[LatencyBucket(ElapsedNs(hedge->begin) / 1000)].fetch_add(1, std::memory_order_relaxed);
+        uint64_t other = hedge->id[1 - copy].load();
+        if (other)
+        {
+            hedge->client[1 - copy]->Cancel(other);
+        }
+        if (copy == 1)
+        {
+            hedge_wins_.fetch_add(1, std::memory_order_relaxed);
+        }
+        hedge->cbk(data, size);
+    }, [this, hedge](int err) {
+        CopyFailed(hedge, err);
+    }, &id);
+
+    if (ret == 0)
+    {
+        // published after client[copy], the winner reads them in the other order
+        hedge->id[copy] = id;
+        return 0;
+    }
+    Eject(*ep);
+    bool last;
+    {
+        std::lock_guard<std::mutex> _(hedge->lock);
+        last = --hedge->live == 0;
+    }
+    // the original failed while this copy was being written, nothing is left to answer.
+    // A first copy that fails is retried on another endpoint or returned to the caller
+    if (copy == 1 && last && !hedge->done.exchange(true))
+    {
+        FinishHedge(hedge.get());
+        if (hedge->err_cbk)
+        {
+            hedge->err_cbk(ret);
+        }
+    }
+    return ret;
+}
+
+void UDSockBalancer::CopyFailed(const std::shared_ptr<Hedge>& hedge, int err)
+{
+    {
+        std::lock_guard<std::mutex> _(hedge->lock);
+        // the other copy may still answer
+        if (--hedge->live > 0)
+        {
+            return;
+        }
+    }
+    // answered or cancelled already, a cancelled loser ends up here
+    if (hedge->done.exchange(true))
+    {
+        return;
+    }
+    // no copy is sent for a request whose only copy failed
+    FinishHedge(hedge.get());
+    if (hedge->err_cbk)
+    {
+        hedge->err_cbk(err);
+    }
+}
+
+void UDSockBalancer::FinishHedge(Hedge* hedge)
+{
+    std::shared_ptr<Hedge> keep, tracked;
+    std::lock_guard<std::mutex> _(lock_hedge_);
+    hedge_wheel_.Cancel(&hedge->timer);
+    keep.swap(hedge->self);
+    if (hedge->key)
+    {
+        auto it = hedged_.find(hedge->key);
+        if (it != hedged_.end())
+        {
+            tracked.swap(it->second);
+            hedged_.erase(it);
+        }
+    }
+}
+
+void UDSockBalancer::HedgeLoop()
+{
+    std::vector<std::shared_ptr<Hedge>> due;
+    while (running_)
+    {
+        {
+            std::unique_lock<std::mutex> lock(lock_hedge_);
+            if (hedge_wheel_.Size() == 0)
+                hedge_cv_.wait_for(lock, std::chrono::microseconds(kMonitorIntervalUs));
+            else
+                hedge_cv_.wait_for(lock, std::chrono::microseconds(kHedgeTickUs));
+            hedge_wheel_.Advance(NowTick(), [&](TimerNode* node) {
+                due.push_back(std::move(reinterpret_cast<Hedge*>(node->data)->self));
+            });
+        }
+
+        for (auto& hedge : due)
+        {
+            if (hedge->done)
+            {
+                continue;
+            }
+            uint64_t budget = budget_requests_.load(std::memory_order_relaxed) * hedge_budget_.load(std::memory_order_relaxed);
+            if (budget_hedges_.load(std::memory_order_relaxed) * 100 >= budget)
+            {
+                continue;
+            }
+            int idx = Pick(hedge->endpoint[0]);
+            if (idx < 0 || SendCopy(idx, hedge, 1) != 0)
+            {
+                continue;
+            }
+            hedges_.fetch_add(1, std::memory_order_relaxed);
+            budget_hedges_.fetch_add(1, std::memory_order_relaxed);
+            // the original may have answered while the copy was written
+            if (hedge->done)
+            {
+                hedge->client[1]->Cancel(hedge->id[1]);
+            }
+        }
+        due.clear();
+    }
+}
+
+void UDSockBalancer::UpdateHedgeDelay()
+{
+    uint32_t percentile = hedge_percentile_.load(std::memory_order_relaxed);
+    if (!percentile)
+    {
+        return;
+    }
+
+    uint64_t total = 0;
+    for (auto& cnt : latency_hist_)
+    {
+        total += cnt.load(std::memory_order_relaxed);
+    }
+    if (total < kHedgeMinSamples)
+    {
+        hedge_delay_ = 0;
+    }
+    else
+    {
+        uint64_t target = (total * percentile + 99) / 100, seen = 0;
+        int bucket = 0;
+        for (; bucket < 255; bucket++)
+        {
+            seen += latency_hist_[bucket].load(std::memory_order_relaxed);
+            if (seen >= target)
+                break;
+        }
+        uint64_t delay = (BucketLimit(bucket) + kHedgeTickUs - 1) / kHedgeTickUs;
+        hedge_delay_ = delay ? delay : 1;
+    }
+
+    // halve the history so the delay and the budget follow recent traffic
+    if (++hedge_rounds_ % kHedgeDecayRounds == 0)
+    {
+        for (auto& cnt : latency_hist_)
+        {
+            cnt.fetch_sub(cnt.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+        }
+        budget_requests_.fetch_sub(budget_requests_.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+        budget_hedges_.fetch_sub(budget_hedges_.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+    }
+}
+
+void UDSockBalancer::SetHedging(uint32_t percentile, uint32_t budget_percent)
+{
+    hedge_percentile_ = percentile > 100 ? 100 : percentile;
+    hedge_budget_ = budget_percent;
+    if (!percentile)
+    {
+        hedge_delay_ = 0;
+    }
+}
+
+uint64_t UDSockBalancer::HedgeCount()
+{
+    return hedges_.load(std::memory_order_relaxed);
+}
+
+uint64_t UDSockBalancer::HedgeWins()
+{
+    return hedge_wins_.load(std::memory_order_relaxed);
+}
+
+int UDSockBalancer::SendOneWay(uint16_t method, std::string& message)
+{
+    int ret = -ENOTCONN;
+    for (size_t attempt = 0; attempt < endpoints_.size(); attempt++)
+    {
+        int idx = Pick();
+        if (idx < 0)
+        {
+            break;
+        }
+        std::shared_ptr<UDSockClient> client = std::atomic_load(&endpoints_[idx]->client);
+        if (client && (ret = client->SendOneWay(method, message)) == 0)
+        {
+            return 0;
+        }
+        Eject(*endpoints_[idx]);
+    }
+    return ret;
+}
+
+void UDSockBalancer::Monitor()
+{
+    while (running_)
+    {
+        uint64_t now = NowMs();
+        for (auto& ep : endpoints_)
+        {
+            std::shared_ptr<UDSockClient> client = std::atomic_load(&ep->client);
+            if (ep->healthy)
+            {
+                if (client && !client->IsConnected())
+                    Eject(*ep);
+                continue;
+            }
+            if (!ep->reported_down)
+            {
+                ep->reported_down = true;
+                LOG_OUT("endpoint ejected", ep->path);
+            }
+            if (now < ep->retry_at_ms)
+            {
+                continue;
+            }
+
+            // a client that exists reconnects by itself, only never-connected endpoints need a new one
+            if ((client && client->IsConnected()) || (!client && Connect(*ep)))
+            {
+                ep->backoff_ms = 0;
+                ep->healthy = true;
+                ep->reported_down = false;
+                LOG_OUT("endpoint restored", ep->path);
+                continue;
+            }
+            ep->backoff_ms = ep->backoff_ms ? std::min(ep->backoff_ms * 2, kEjectMaxMs) : kEjectMinMs;
+            ep->retry_at_ms = now + ep->backoff_ms;
+        }
+        UpdateHedgeDelay();
+        usleep(kMonitorIntervalUs);
+    }
+}
+
+void UDSockBalancer::Stop()
+{
+    running_ = false;
+    hedge_cv_.notify_all();
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+    if (hedge_thread_.joinable())
+    {
+        hedge_thread_.join();
+    }
+    std::vector<std::shared_ptr<Hedge>> armed;
+    {
+        std::lock_guard<std::mutex> _(lock_hedge_);
+        hedge_wheel_.Clear([&](TimerNode* node) {
+            armed.push_back(std::move(reinterpret_cast<Hedge*>(node->data)->self));
+        });
+    }
+    for (auto& ep : endpoints_)
+    {
+        std::shared_ptr<UDSockClient> client = std::atomic_load(&ep->client);
+        if (client)
+        {
+            client->Stop();
+        }
+    }
+    endpoints_.clear();
+}
+
+size_t UDSockBalancer::HealthyCount()
+{
+    size_t cnt = 0;
+    for (auto& ep : endpoints_)
+    {
+        if (ep->healthy)
+            cnt++;
+    }
+    return cnt;
+}
@@ -0,0 +1,151 @@
+#ifndef _POLL_BALANCER_
+#define _POLL_BALANCER_
+#include <memory>
+#include <vector>
+#include "poll_client.h"
+#include "timer_wheel.h"
+
+// spreads requests over several server socket paths with power-of-two-choices,
+// endpoints that fail are ejected and brought back by a background thread
+class UDSockBalancer
+{
+    using OnDisconnct = std::function<void()>;
+    using ResponseCbk = std::function<void(char* data, uint64_t size)>;
+    using ErrorCbk = std::function<void(int err)>;
+
+    struct Endpoint
+    {
+        std::string path;
+        std::shared_ptr<UDSockClient> client;
+        std::atomic<bool> healthy;
+        std::atomic<uint64_t> latency_ns;   // moving average of response time
+        std::atomic<uint64_t> retry_at_ms;  // not used before this time once ejected
+        uint32_t backoff_ms;
+        bool reported_down;                 // the monitor logged the ejection
+
+        Endpoint(const std::string& path) 
+            : path(path), healthy(false), latency_ns(0), retry_at_ms(0), backoff_ms(0), reported_down(false) {}
+    };
+
+    // one logical request sent as up to two copies, the first response wins. It fails
+    // once every copy sent failed and no copy is going to be sent any more
+    struct Hedge
+    {
+        TimerNode timer;
+        std::shared_ptr<Hedge> self;        // keeps it alive while the timer is armed
+        uint16_t method;
+        std::string request;
+        ResponseCbk cbk;
+        ErrorCbk err_cbk;
+        struct timespec begin;
+        int endpoint[2];
+        std::shared_ptr<UDSockClient> client[2];
+        std::atomic<uint64_t> id[2];        // 0 until the copy is written
+        std::atomic<bool> done;             // answered, failed or cancelled
+        std::mutex lock;
+        int live;                           // copies written and not failed, under lock
+        uint64_t key;                       // in hedged_ when the caller took an id, else 0
+
+        Hedge() : method(0), done(false), live(0), key(0)
+        {
+            endpoint[0] = endpoint[1] = -1;
+            id[0] = id[1] = 0;
+        }
+    };
+
+public:
+    UDSockBalancer(const int& buffer_size = 5120);
+
+    ~UDSockBalancer();
+
+    // succeeds when at least one endpoint is reachable, the others keep being retried
+    bool Init(const std::vector<std::string>& server_addrs, const OnDisconnct& on_disconn);
+
+    int SendRequest(std::string& request, const ResponseCbk& result_cbk);
+
+    // on_error gets -ECONNRESET, -ETIMEDOUT or -ECANCELED as from UDSockClient, once for a
+    // hedged request after all its copies failed. req_id receives the id to pass to Cancel()
+    int SendRequest(uint16_t method, std::string& request, const ResponseCbk& result_cbk,
+        const ErrorCbk& on_error = nullptr, uint64_t* req_id = nullptr);
+
+    // withdraw a pending request, every copy of a hedged one, its on_error gets -ECANCELED.
+    // -ENOENT when it already completed
+    int Cancel(uint64_t req_id);
+
+    int SendOneWay(uint16_t method, std::string& message);
+
+    // send a second copy to another endpoint when no response arrived within the given
+    // percentile of recent latencies, at most budget_percent of requests get a copy,
+    // 0 disables hedging
+    void SetHedging(uint32_t percentile, uint32_t budget_percent);
+
+    // copies sent, and copies that answered before the original
+    uint64_t HedgeCount();
+
+    uint64_t HedgeWins();
+
+    void Stop();
+
+    size_t HealthyCount();
+
+protected:
+
+    // index of the chosen endpoint, -1 when none is usable
+    int Pick(int exclude = -1);
+
+    inline uint64_t Score(Endpoint& ep, UDSockClient* client);
+
+    void Eject(Endpoint& ep);
+
+    bool Connect(Endpoint& ep);
+
+    void Monitor();
+
+    inline void RecordLatency(Endpoint& ep, const struct timespec& begin);
+
+    int SendHedged(uint16_t method, std::string& request, const ResponseCbk& result_cbk,
+        const ErrorCbk& on_error, uint64_t* req_id);
+
+    int SendCopy(int idx, const std::shared_ptr<Hedge>& hedge, int copy);
+
+    // a copy failed after it was written
+    void CopyFailed(const std::shared_ptr<Hedge>& hedge, int err);
+
+    // the request completed: disarm its timer and forget its id
+    void FinishHedge(Hedge* hedge);
+
+    void UpdateHedgeDelay();
+
+    void HedgeLoop();
+
+    static uint64_t NowMs();
+
+    static uint64_t NowTick();
+
+private:
+
+    int buffer_size_;
+    OnDisconnct on_disconn_;
+    std::vector<std::unique_ptr<Endpoint>> endpoints_;
+    std::thread thread_;
+    volatile bool running_;
+
+    // hedging, latencies are kept in log2 buckets with 4 sub-buckets, in microseconds
+    std::atomic<uint32_t> hedge_percentile_;
+    std::atomic<uint32_t> hedge_budget_;
+    std::atomic<uint64_t> hedge_delay_;     // in wheel ticks, 0 while there are too few samples
+    std::atomic<uint32_t> latency_hist_[256];
+    std::atomic<uint64_t> budget_requests_;
+    std::atomic<uint64_t> budget_hedges_;
+    std::atomic<uint64_t> hedges_;
+    std::atomic<uint64_t> hedge_wins_;
+    int hedge_rounds_;
+    std::mutex lock_hedge_;
+    std::condition_variable hedge_cv_;
+    TimerWheel hedge_wheel_;
+    std::unordered_map<uint64_t, std::shared_ptr<Hedge>> hedged_;  // by key, under lock_hedge_
+    std::atomic<uint64_t> next_key_;
+    std::thread hedge_thread_;
+};
+
+#endif // _POLL_BALANCER_
@@ -1,20 +1,37 @@
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <errno.h>
+#include <time.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <random>
 #include <cstring>
 #include <assert.h>
 #include "poll_client.h"
+#include "perf_counter.h"
 
 
 UDSockClient::UDSockClient(const int& buffer_size)
-    :buffer_size_(buffer_size), sock_(-1), running_(false) 
+    :buffer_size_(buffer_size), sock_(-1), oneway_seq_(1), oneway_stream_(0), stream_sent_(false), running_(false), request_id_(1), tfd_(-1), timer_at_(0), timeout_ms_(kCleanTimeoutRequest), coalesced_(0), 
+    max_inflight_(0), max_inflight_bytes_(0), server_credits_(0), window_policy_(kWindowBlock), inflight_(0), 
+    inflight_bytes_(0), offline_policy_(kOfflineFail), max_offline_(0), crc_flag_(0), max_frame_size_(kMaxFrameSize)
 {
-
+    wheel_.Reset(NowMs());
+    // drives request timeouts, armed one-shot for the wheel's next tick (ms of CLOCK_MONOTONIC)
+    tfd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    // distinct for every client, also for several in one process
+    std::random_device rd;
+    while (!oneway_stream_)
+    {
+        oneway_stream_ = ((uint64_t)rd() << 32) | rd();
+    }
 }
 
 UDSockClient::~UDSockClient() 
 {
     CLOSE_FD(sock_);
+    CLOSE_FD(tfd_);
 }
 
 bool UDSockClient::Init(const std::string& server_addr, const OnDisconnct& on_disconn)
@@ -49,43 +66,84 @@ bool UDSockClient::Init(const std::string& server_addr, const OnDisconnct& on_di
     return true;
 }
 
+uint64_t UDSockClient::NowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
 bool UDSockClient::ConnectServer()
 {
     int tmp_sock;
-    if ((tmp_sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) 
+    if ((tmp_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) 
     {
         return false;
     }
 
-    if (SetNonBlocking(tmp_sock) < 0)
+    // a unix socket connect either completes at once or fails with EAGAIN when
+    // the backlog is full, it never blocks the loop
+    if (connect(tmp_sock, (struct sockaddr*)&addr_, sizeof(addr_)) == -1) 
     {
+        close(tmp_sock);
         return false;
     }
 
-    on_disconn_();
+    // senders keep the blocking semantics of the socket created by Init()
+    int flags = fcntl(tmp_sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(tmp_sock, F_SETFL, flags & ~O_NONBLOCK) == -1)
+    {
+        close(tmp_sock);
+        return false;
+    }
 
-    for (int retry = 1; retry <= 10; retry++)
     {
-        if (connect(tmp_sock, (struct sockaddr*)&addr_, sizeof(addr_)) == -1) 
-        {
-            std::cout << "connect server failed, retry count:" << retry << std::endl;
-            CleanRequest();
-            usleep(100000);
-            continue;
-        }
+        std::lock_guard<std::mutex> _(lock_send_);
         sock_ = tmp_sock;
-        return true;
+        stream_sent_ = false;
     }
-    return false;
+
+    std::vector<uint16_t> topics;
+    {
+        std::lock_guard<std::mutex> _(lock_stream_);
+        for (auto& it : streams_)
+            topics.push_back(it.first);
+    }
+    for (auto topic : topics)
+    {
+        SendControl(kFlagSubscribe, topic);
+    }
+
+    FlushQueued();
+    return true;
+}
+
+void UDSockClient::Disconnect(int efd, Buffer& buffer)
+{
+    if (epoll_ctl(efd, EPOLL_CTL_DEL, sock_, NULL) == -1)
+    {
+        perror("EPOLL_CTL_DEL");
+    }
+    {
+        std::lock_guard<std::mutex> _(lock_send_);
+        CLOSE_FD(sock_);
+    }
+    buffer.ResetPos();
+    FlightRecorder::Record(kFlightDisconnect, -1, inflight_.load());
+    FailPending(-ECONNRESET);
+    on_disconn_();
 }
 
 void UDSockClient::Run()
 {
     constexpr int kHeadSize = sizeof(RpcRequestHdr);
-    int ev_cnt = 0, res = 0;
+    int res = 0, timeout = 0;
+    uint32_t backoff = 0;
+    uint64_t retry_at = 0;
+    unsigned int seed = (unsigned int)NowMs() ^ (unsigned int)(uintptr_t)this;
     Buffer buffer(buffer_size_);
-    struct epoll_event ev;
-    int efd = epoll_create(1);
+    struct epoll_event ev, events[2];
+    int efd = epoll_create(2);
     if (efd == -1)
     {
         perror("epoll_create");
@@ -100,120 +158,620 @@ void UDSockClient::Run()
         if (res == -1)
         {
             perror("epoll_ctl");
+            close(efd);
             return;
         }  
     }
 
+    // the wheel is advanced whenever the timer fires, an idle client is never woken
+    int tfd = tfd_;
+    ev.events = EPOLLIN;
+    ev.data.fd = tfd;
+    if (tfd == -1 || epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &ev) == -1)
+    {
+        perror("timerfd");
+        close(efd);
+        return;
+    }
 
     running_ = true;
 
     while(running_)
     {
+        // nothing to do until a frame, the timer or Stop() arrives
+        timeout = -1;
         if (sock_ == -1)
         {
-            if (ConnectServer())
+            uint64_t now = NowMs();
+            if (now >= retry_at && ConnectServer())
             {
-                res = epoll_ctl(efd, EPOLL_CTL_ADD, sock_, &ev);
-                if (res == -1)
+                ev.events = EPOLLIN;
+                ev.data.fd = sock_;
+                if (epoll_ctl(efd, EPOLL_CTL_ADD, sock_, &ev) == -1)
                 {
                     perror("epoll_ctl");
-                    return;
-                }  
+                }
+                backoff = 0;
+                FlightRecorder::Record(kFlightConnect, sock_, 0);
+            }
+            else
+            {
+                if (now >= retry_at)
+                {
+                    // jittered exponential backoff, so restarted servers are not hit by every client at once
+                    backoff = backoff ? std::min(backoff * 2, kReconnectMaxMs) : kReconnectMinMs;
+                    retry_at = now + backoff / 2 + rand_r(&seed) % backoff;
+                }
+                timeout = retry_at - now;
             }
-            else 
-                continue;
         }
 
-        if (epoll_wait(efd, &ev, 1, 10) <= 0)
+        PERF_PHASE(kPhaseEpoll);
+        int ev_cnt = epoll_wait(efd, events, 2, timeout);
+        PERF_PHASE(kPhaseParse);
+        for (int i = 0; i < ev_cnt; i++)
         {
-            continue;
-        }
+            if (events[i].data.fd == tfd)
+            {
+                uint64_t ticks;
+                if (read(tfd, &ticks, sizeof(ticks)) > 0)
+                {
+                    ExpireRequests();
+                }
+                continue;
+            }
 
-        if (ev.events & (EPOLLERR | EPOLLHUP))
-        {
-            if (ev.events & EPOLLERR)
-                LOG_OUT("POLLERR event", strerror(errno));
-            else
-                LOG_OUT("POLLHUP event", strerror(errno));
+            if (events[i].data.fd != sock_)
+            {
+                continue;
+            }
 
-            res = epoll_ctl(efd, EPOLL_CTL_DEL, ev.data.fd, NULL);
-            if (res == -1)
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
             {
-                perror("EPOLL_CTL_DEL");
+                FlightRecorder::Record(kFlightClose, sock_, events[i].events);
+                Disconnect(efd, buffer);
+                retry_at = 0;
+                continue;
             }
-            buffer.ResetPos();
-            CLOSE_FD(sock_);
-            continue;
-        }
-    
-        if (ev.events & EPOLLIN)
-        {
-            int bytes = RecvData(sock_, buffer.PitAddr(), buffer.PitSize());
-            if (bytes > 0)
+        
+            if (events[i].events & EPOLLIN)
             {
-                buffer.Fill(bytes);
-                while(buffer.DataSize() > kHeadSize)
+                int bytes = RecvData(sock_, buffer.PitAddr(), buffer.PitSize());
+                if (bytes > 0)
                 {
-                    RpcRequestHdr* head = reinterpret_cast<RpcRequestHdr*>(buffer.DataAddr());
-                    int total_size = head->data_size + kHeadSize;
-                    if (total_size > buffer.Size())
-                    {
-                        buffer.Expand(total_size + 2 * kHeadSize);
-                    }
-                    if (total_size <= buffer.DataSize())
+                    uint32_t frames = 0;
+                    FlightRecorder::Record(kFlightRead, sock_, bytes);
+                    buffer.Fill(bytes);
+                    bool bad = false;
+                    while(buffer.DataSize() >= kHeadSize)
                     {
+                        RpcRequestHdr* head = reinterpret_cast<RpcRequestHdr*>(buffer.DataAddr());
+                        // a length that cannot be trusted leaves no frame boundary to resync on
+                        if (head->data_size > max_frame_size_)
+                        {
+                            FlightRecorder::Record(kFlightBadFrame, sock_, head->data_size, 0);
+                            bad = true;
+                            break;
+                        }
+                        int total_size = head->data_size + kHeadSize;
+                        if (total_size > buffer.Size())
                         {
-                            std::lock_guard<std::mutex> _(lock_req_);
-                            auto it = request_.find(head->id);
-                            if (it != request_.end())
+                            buffer.Expand(total_size + 2 * kHeadSize);
+                        }
+                        if (total_size <= buffer.DataSize())
+                        {
+                            if (!OpenFrame(head))
                             {
-                                it->second(buffer.DataAddr() + kHeadSize, head->data_size);
-                                request_.erase(head->id);
+                                FlightRecorder::Record(kFlightBadFrame, sock_, head->data_size, 1);
+                                bad = true;
+                                break;
                             }
+                            HandleFrame(head, buffer.DataAddr() + kHeadSize);
+                            buffer.Dig(total_size);
+                            frames++;
+                        }
+                        else
+                        {
+                            break;
                         }
-                        buffer.Dig(total_size);
                     }
-                    else
+                    FlightRecorder::Record(kFlightFrames, sock_, frames);
+                    if (bad)
                     {
-                        break;
+                        Disconnect(efd, buffer);
+                        retry_at = 0;
+                        continue;
                     }
+                    buffer.Move();
+                }
+                else if (bytes < 0 && running_)
+                {
+                    FlightRecorder::Record(kFlightRecvError, sock_, errno);
+                    Disconnect(efd, buffer);
+                    retry_at = 0;
                 }
-                buffer.Move();
             }
         }
     }
 
+    close(efd);
+    FailPending(-ECANCELED);
+
     std::cout << "udsocket client thread exit" << std::endl;
 }
 
+void UDSockClient::HandleFrame(RpcRequestHdr* head, char* data)
+{
+    if (head->flags & kFlagPush)
+    {
+        // called without lock_stream_ held so it may subscribe or unsubscribe
+        ResponseCbk on_push;
+        {
+            std::lock_guard<std::mutex> _(lock_stream_);
+            auto it = streams_.find(head->method);
+            if (it != streams_.end())
+            {
+                on_push = it->second;
+            }
+        }
+        if (on_push)
+        {
+            on_push(data, head->data_size);
+        }
+        return;
+    }
+
+    if (head->flags & kFlagCredit)
+    {
+        std::lock_guard<std::mutex> _(lock_req_);
+        server_credits_ = head->id;
+        window_cv_.notify_all();
+        return;
+    }
+
+    // callbacks run without lock_req_ held so they may send or cancel requests
+    RequestValue done;
+    ChunkCbk chunk_cbk;
+    bool last = true, released = false;
+    {
+        std::lock_guard<std::mutex> _(lock_req_);
+        auto it = request_.find(head->id);
+        if (it == request_.end())
+        {
+            return;
+        }
+
+        last = !(head->flags & kFlagChunk) || (head->flags & kFlagLast);
+        if (!last)
+        {
+            chunk_cbk = it->second.chunk_cbk;
+            if (it->second.timer.Linked())
+                wheel_.Add(&it->second.timer, NowMs() + timeout_ms_);
+        }
+        else
+        {
+            wheel_.Cancel(&it->second.timer);
+            ReleaseWindow(it->second);
+            LeaveFlight(it->first, it->second);
+            done = std::move(it->second);
+            request_.erase(it);
+            released = !queued_.empty();
+        }
+    }
+
+    PERF_PHASE(kPhaseHandler);
+    if (!last)
+    {
+        if (chunk_cbk)
+            chunk_cbk(data, head->data_size, false);
+        PERF_PHASE(kPhaseParse);
+        return;
+    }
+
+    if (done.raw_cbk)
+        done.raw_cbk(done.raw_ctx, 0, data, head->data_size);
+    else if (done.cbk)
+        done.cbk(data, head->data_size);
+    else if (done.chunk_cbk)
+        done.chunk_cbk(data, head->data_size, true);
+    if (done.flight)
+    {
+        for (auto& waiter : done.flight->waiters)
+        {
+            if (waiter.first)
+                waiter.first(data, head->data_size);
+        }
+    }
+    PERF_PHASE(kPhaseParse);
+
+    if (released)
+    {
+        FlushQueued();
+    }
+}
+
 int UDSockClient::SendRequest(std::string& request, const ResponseCbk& response_cbk)
 {
-    static uint64_t request_id = 1;
+    return SendRequest(0, request, response_cbk);
+}
+
+int UDSockClient::SendRequest(uint16_t method, std::string& request, const ResponseCbk& response_cbk, 
+    const ErrorCbk& on_error, uint64_t* req_id)
+{
+    RequestValue value;
+    value.cbk = response_cbk;
+    value.err_cbk = on_error;
+    return DoSend(method, request, value, req_id);
+}
+
+int UDSockClient::SendStreamRequest(uint16_t method, std::string& request, const ChunkCbk& on_chunk, 
+    const ErrorCbk& on_error, uint64_t* req_id)
+{
+    RequestValue value;
+    value.chunk_cbk = on_chunk;
+    value.err_cbk = on_error;
+    return DoSend(method, request, value, req_id);
+}
+
+int UDSockClient::SendRaw(uint16_t method, std::string& request, RawCbk cbk, void* ctx, uint64_t* req_id)
+{
+    RequestValue value;
+    value.raw_cbk = cbk;
+    value.raw_ctx = ctx;
+    // two pointers fit the small buffer of std::function, the error path does not allocate
+    value.err_cbk = [cbk, ctx](int err) { cbk(ctx, err, nullptr, 0); };
+    return DoSend(method, request, value, req_id);
+}
+
+int UDSockClient::SendIdempotent(uint16_t method, std::string& request, const ResponseCbk& response_cbk, 
+    const ErrorCbk& on_error)
+{
+    RequestValue value;
+    value.cbk = response_cbk;
+    value.err_cbk = on_error;
+    value.flight = std::make_shared<Flight>();
+    value.flight->hash = std::hash<std::string>()(request) ^ method;
+    value.flight->method = method;
+    return DoSend(method, request, value, nullptr);
+}
+
+uint64_t UDSockClient::Coalesced()
+{
+    std::lock_guard<std::mutex> _(lock_req_);
+    return coalesced_;
+}
+
+inline bool UDSockClient::JoinFlight(uint16_t method, std::string& request, RequestValue& value)
+{
+    auto range = flights_.equal_range(value.flight->hash);
+    for (auto fit = range.first; fit != range.second; ++fit)
+    {
+        auto it = request_.find(fit->second);
+        if (it == request_.end())
+        {
+            continue;
+        }
+        Flight* flight = it->second.flight.get();
+        if (flight->method == method && flight->key == request)
+        {
+            flight->waiters.push_back(std::make_pair(value.cbk, value.err_cbk));
+            coalesced_++;
+            return true;
+        }
+    }
+    // this one goes out, later callers compare against its body
+    value.flight->key = request;
+    return false;
+}
+
+inline void UDSockClient::LeaveFlight(uint64_t id, const RequestValue& value)
+{
+    if (!value.flight)
+    {
+        return;
+    }
+    auto range = flights_.equal_range(value.flight->hash);
+    for (auto fit = range.first; fit != range.second; ++fit)
+    {
+        if (fit->second == id)
+        {
+            flights_.erase(fit);
+            return;
+        }
+    }
+}
+
+void UDSockClient::TakeErrorCbks(RequestValue& value, std::vector<ErrorCbk>& out)
+{
+    if (value.err_cbk)
+    {
+        out.push_back(std::move(value.err_cbk));
+    }
+    if (value.flight)
+    {
+        for (auto& waiter : value.flight->waiters)
+        {
+            if (waiter.second)
+                out.push_back(std::move(waiter.second));
+        }
+        value.flight->waiters.clear();
+    }
+}
+
+int UDSockClient::Cancel(uint64_t req_id)
+{
+    ErrorCbk err_cbk;
+    bool sent = false, released = false;
+    {
+        std::lock_guard<std::mutex> _(lock_req_);
+        auto it = request_.find(req_id);
+        if (it != request_.end() && it->second.flight && !it->second.flight->waiters.empty())
+        {
+            // other callers still wait for this response, hand the request over to one of them
+            Flight* flight = it->second.flight.get();
+            err_cbk = std::move(it->second.err_cbk);
+            it->second.cbk = std::move(flight->waiters.front().first);
+            it->second.err_cbk = std::move(flight->waiters.front().second);
+            flight->waiters.erase(flight->waiters.begin());
+        }
+        else if (it != request_.end())
+        {
+            err_cbk = std::move(it->second.err_cbk);
+            wheel_.Cancel(&it->second.timer);
+            ReleaseWindow(it->second);
+            LeaveFlight(it->first, it->second);
+            request_.erase(it);
+            sent = true;
+            released = !queued_.empty();
+        }
+        else
+        {
+            // never written, dropping it from the queue is enough
+            auto qit = std::find_if(queued_.begin(), queued_.end(), 
+                [req_id](const QueuedRequest& req) { return req.id == req_id; });
+            if (qit == queued_.end())
+            {
+                return -ENOENT;
+            }
+            err_cbk = std::move(qit->value.err_cbk);
+            queued_.erase(qit);
+        }
+    }
+
+    if (sent && sock_ != -1)
+    {
+        SendControl(kFlagCancel, 0, req_id);
+    }
+    if (err_cbk)
+    {
+        err_cbk(-ECANCELED);
+    }
+    if (released && sock_ != -1)
+    {
+        FlushQueued();
+    }
+    return 0;
+}
+
+inline void UDSockClient::QueueFrame(RpcRequestHdr& head, std::string& request, const RequestValue& value)
+{
+    QueuedRequest req;
+    req.id = head.id = request_id_++;
+    req.value = value;
+    uint32_t crc = 0;
+    if (head.flags & kFlagCrc)
+    {
+        crc = SealFrame(&head, request.c_str(), request.size());
+    }
+    req.frame.reserve(sizeof(RpcRequestHdr) + request.size() + kCrcSize);
+    req.frame.append((char*)&head, sizeof(RpcRequestHdr));
+    req.frame.append(request);
+    if (head.flags & kFlagCrc)
+    {
+        req.frame.append((char*)&crc, kCrcSize);
+    }
+    queued_.push_back(std::move(req));
+}
+
+int UDSockClient::DoSend(uint16_t method, std::string& request, RequestValue& value, uint64_t* req_id)
+{
     RpcRequestHdr head;
-    ResponseCbk cbk = response_cbk;
 
+    if (request.size() > max_frame_size_ - kCrcSize)
+    {
+        return -EMSGSIZE;
+    }
     head.data_size = request.size();
+    head.method = method;
+    head.flags = crc_flag_;
+    value.size = request.size();
 
     {
-        std::lock_guard<std::mutex> _(lock_req_);
-        head.id = request_id++;
-        request_.insert(std::make_pair(head.id, cbk));
+        std::unique_lock<std::mutex> lock(lock_req_);
+        if (value.flight && JoinFlight(method, request, value))
+        {
+            return 0;
+        }
+        if (sock_ == -1)
+        {
+            if (offline_policy_ == kOfflineBuffer && queued_.size() < max_offline_)
+            {
+                QueueFrame(head, request, value);
+                if (req_id)
+                    *req_id = head.id;
+                return 0;
+            }
+            return -ENOTCONN;
+        }
+        if (!queued_.empty() || !WindowOpen(value.size))
+        {
+            if (window_policy_ == kWindowFailFast)
+            {
+                return -EAGAIN;
+            }
+            // waiting on the receive thread would keep the responses that free the window from being read
+            if (window_policy_ == kWindowQueue || std::this_thread::get_id() == thread_.get_id())
+            {
+                QueueFrame(head, request, value);
+                if (req_id)
+                    *req_id = head.id;
+                return 0;
+            }
+            window_cv_.wait(lock, [&]() { return WindowOpen(value.size) || !running_; });
+        }
+        head.id = request_id_++;
+        TrackRequest(head.id, value);
+        if (req_id)
+            *req_id = head.id;
     }
 
+    int ret = 0;
+    PERF_PHASE(kPhaseWrite);
     {
+        uint32_t crc = 0;
+        if (crc_flag_)
+        {
+            crc = SealFrame(&head, request.c_str(), request.size());
+        }
         std::lock_guard<std::mutex> _(lock_send_);
-        if (WriteVec(sock_, &head, sizeof(RpcRequestHdr), (void*)request.c_str(), request.size()) == -1)
+        if (WriteVec(sock_, &head, sizeof(RpcRequestHdr), (void*)request.c_str(), request.size(), 
+            crc_flag_ ? &crc : nullptr, crc_flag_ ? kCrcSize : 0) == -1)
+        {
+            ret = -errno;
+        }
+    }
+    PERF_PHASE(kPhaseOther);
+
+    if (ret < 0)
+    {
+        // the caller sees the error now, do not leave a callback behind
+        std::vector<ErrorCbk> failed;
+        {
+            std::lock_guard<std::mutex> _(lock_req_);
+            auto it = request_.find(head.id);
+            if (it != request_.end())
+            {
+                wheel_.Cancel(&it->second.timer);
+                ReleaseWindow(it->second);
+                LeaveFlight(it->first, it->second);
+                it->second.err_cbk = nullptr;
+                TakeErrorCbks(it->second, failed);
+                request_.erase(it);
+            }
+            else
+            {
+                // a disconnect already failed it through its callbacks, report it once
+                ret = 0;
+            }
+        }
+        // callers that attached in the meantime learn it from their own callback
+        for (auto& cbk : failed)
+        {
+            cbk(ret);
+        }
+    }
+
+    return ret;
+}
+
+int UDSockClient::SendOneWay(uint16_t method, std::string& message)
+{
+    RpcRequestHdr head;
+    head.data_size = message.size();
+    head.method = method;
+    head.flags = kFlagOneWay | crc_flag_;
+
+    std::lock_guard<std::mutex> _(lock_send_);
+    if (!stream_sent_)
+    {
+        char frame[sizeof(RpcRequestHdr) + kCrcSize];
+        size_t size = ControlFrame(frame, kFlagStream, 0, oneway_stream_);
+        if (SendBytes(sock_, frame, size) == -1)
         {
             return -errno;
         }
+        stream_sent_ = true;
+    }
+    head.id = oneway_seq_++;
+    uint32_t crc = 0;
+    if (crc_flag_)
+    {
+        crc = SealFrame(&head, message.c_str(), message.size());
+    }
+    if (WriteVec(sock_, &head, sizeof(RpcRequestHdr), (void*)message.c_str(), message.size(), 
+        crc_flag_ ? &crc : nullptr, crc_flag_ ? kCrcSize : 0) == -1)
+    {
+        return -errno;
     }
+    return 0;
+}
 
+size_t UDSockClient::ControlFrame(char* frame, uint16_t flags, uint16_t method, uint64_t id)
+{
+    RpcRequestHdr head;
+    head.id = id;
+    head.data_size = 0;
+    head.method = method;
+    head.flags = flags | crc_flag_;
+
+    size_t size = sizeof(RpcRequestHdr);
+    if (crc_flag_)
+    {
+        uint32_t crc = SealFrame(&head, nullptr, 0);
+        memcpy(frame + size, &crc, kCrcSize);
+        size += kCrcSize;
+    }
+    memcpy(frame, &head, sizeof(RpcRequestHdr));
+    return size;
+}
+
+int UDSockClient::SendControl(uint16_t flags, uint16_t method, uint64_t id)
+{
+    char frame[sizeof(RpcRequestHdr) + kCrcSize];
+    size_t size = ControlFrame(frame, flags, method, id);
+
+    std::lock_guard<std::mutex> _(lock_send_);
+    if (SendBytes(sock_, frame, size) == -1)
+    {
+        return -errno;
+    }
     return 0;
 }
 
+int UDSockClient::Subscribe(uint16_t topic, const ResponseCbk& on_push)
+{
+    {
+        std::lock_guard<std::mutex> _(lock_stream_);
+        streams_[topic] = on_push;
+    }
+    return SendControl(kFlagSubscribe, topic);
+}
+
+int UDSockClient::Unsubscribe(uint16_t topic)
+{
+    {
+        std::lock_guard<std::mutex> _(lock_stream_);
+        streams_.erase(topic);
+    }
+    return SendControl(kFlagUnsubscribe, topic);
+}
+
 void UDSockClient::Stop()
 {
-    running_ = false;
+    {
+        std::lock_guard<std::mutex> _(lock_req_);
+        running_ = false;
+        window_cv_.notify_all();
+        // wake the loop, it does not poll running_
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        spec.it_value.tv_nsec = 1;
+        if (tfd_ != -1)
+        {
+            timerfd_settime(tfd_, 0, &spec, NULL);
+            timer_at_ = 1;      // no tick of the wheel, the next ArmTimer() sets it anew
+        }
+    }
     CLOSE_FD(sock_);
     if (thread_.joinable())
     {
@@ -221,10 +779,213 @@ void UDSockClient::Stop()
     }
 }
 
-inline void UDSockClient::CleanRequest()
+void UDSockClient::FailPending(int err)
+{
+    std::unordered_map<uint64_t, RequestValue> pending;
+    std::deque<QueuedRequest> queued;
+    {
+        std::lock_guard<std::mutex> _(lock_req_);
+        wheel_.Clear();
+        ArmTimer();
+        flights_.clear();
+        pending.swap(request_);
+        // queued frames were never written, they survive a reconnect when buffering is enabled
+        if (offline_policy_ == kOfflineFail || !running_)
+        {
+            queued.swap(queued_);
+        }
+        inflight_ = 0;
+        inflight_bytes_ = 0;
+        window_cv_.notify_all();
+    }
+
+    std::vector<ErrorCbk> failed;
+    for (auto& it : pending)
+    {
+        TakeErrorCbks(it.second, failed);
+    }
+    for (auto& cbk : failed)
+    {
+        cbk(err);
+    }
+    for (auto& req : queued)
+    {
+        if (req.value.err_cbk)
+            req.value.err_cbk(err);
+    }
+}
+
+void UDSockClient::SetOfflinePolicy(OfflinePolicy policy, uint32_t max_buffered)
 {
     std::lock_guard<std::mutex> _(lock_req_);
-    request_.clear();
+    offline_policy_ = policy;
+    max_offline_ = max_buffered;
+}
+
+void UDSockClient::SetWindow(uint32_t max_requests, uint64_t max_bytes, WindowPolicy policy)
+{
+    std::lock_guard<std::mutex> _(lock_req_);
+    max_inflight_ = max_requests;
+    max_inflight_bytes_ = max_bytes;
+    window_policy_ = policy;
+    window_cv_.notify_all();
+}
+
+uint32_t UDSockClient::InFlight()
+{
+    return inflight_.load(std::memory_order_relaxed);
+}
+
+inline bool UDSockClient::WindowOpen(uint32_t size)
+{
+    uint32_t limit = max_inflight_;
+    if (server_credits_ && (!limit || server_credits_ < limit))
+    {
+        limit = server_credits_;
+    }
+    if (limit && inflight_ >= limit)
+    {
+        return false;
+    }
+    // a single request larger than the byte window still goes out when nothing else is in flight
+    if (max_inflight_bytes_ && inflight_ && inflight_bytes_ + size > max_inflight_bytes_)
+    {
+        return false;
+    }
+    return true;
+}
+
+inline void UDSockClient::TrackRequest(uint64_t id, const RequestValue& value)
+{
+    auto res = request_.insert(std::make_pair(id, value));
+    inflight_++;
+    inflight_bytes_ += value.size;
+    if (value.flight)
+    {
+        flights_.insert(std::make_pair(value.flight->hash, id));
+    }
+    if (timeout_ms_)
+    {
+        uint64_t now = NowMs();
+        if (!wheel_.Size())
+        {
+            // an empty wheel is not ticked, catch it up before it measures from a stale tick
+            wheel_.Advance(now, [](TimerNode*) {});
+        }
+        res.first->second.timer.data = id;
+        wheel_.Add(&res.first->second.timer, now + timeout_ms_);
+        // under load the timer is already set earlier than this one
+        if (!timer_at_ || res.first->second.timer.expire < timer_at_)
+        {
+            ArmTimer();
+        }
+    }
+}
+
+inline void UDSockClient::ArmTimer()
+{
+    uint64_t next = wheel_.NextTick();
+    if (next == UINT64_MAX)
+    {
+        next = 0;
+    }
+    if (tfd_ == -1 || next == timer_at_)
+    {
+        return;
+    }
+    // absolute, a tick already past fires at once
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = spec.it_interval.tv_nsec = 0;
+    spec.it_value.tv_sec = next / 1000;
+    spec.it_value.tv_nsec = (next % 1000) * 1000000;
+    if (timerfd_settime(tfd_, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+    {
+        perror("timerfd_settime");
+        return;
+    }
+    timer_at_ = next;
+}
+
+void UDSockClient::SetChecksum(bool enable)
+{
+    crc_flag_ = enable ? kFlagCrc : 0;
+}
+
+void UDSockClient::SetMaxFrameSize(uint32_t max_bytes)
+{
+    max_frame_size_ = max_bytes;
+}
+
+void UDSockClient::SetTimeout(uint32_t timeout_ms)
+{
+    std::lock_guard<std::mutex> _(lock_req_);
+    timeout_ms_ = timeout_ms;
+}
+
+void UDSockClient::ExpireRequests()
+{
+    std::vector<ErrorCbk> expired;
+    bool released = false;
+    {
+        std::lock_guard<std::mutex> _(lock_req_);
+        wheel_.Advance(NowMs(), [&](TimerNode* node) {
+            auto it = request_.find(node->data);
+            if (it == request_.end())
+            {
+                return;
+            }
+            TakeErrorCbks(it->second, expired);
+            ReleaseWindow(it->second);
+            LeaveFlight(it->first, it->second);
+            request_.erase(it);
+        });
+        // the one-shot timer fired, set it for what is left
+        timer_at_ = 0;
+        ArmTimer();
+        released = !queued_.empty();
+    }
+
+    if (!expired.empty())
+    {
+        FlightRecorder::Record(kFlightTimeout, sock_, expired.size());
+    }
+    for (auto& cbk : expired)
+    {
+        cbk(-ETIMEDOUT);
+    }
+    if (released && sock_ != -1)
+    {
+        FlushQueued();
+    }
+}
+
+inline void UDSockClient::ReleaseWindow(const RequestValue& value)
+{
+    inflight_--;
+    inflight_bytes_ -= value.size;
+    window_cv_.notify_all();
+}
+
+void UDSockClient::FlushQueued()
+{
+    std::vector<std::string> frames;
+    {
+        std::lock_guard<std::mutex> _(lock_req_);
+        while (!queued_.empty() && WindowOpen(queued_.front().value.size))
+        {
+            QueuedRequest& req = queued_.front();
+            TrackRequest(req.id, req.value);
+            frames.push_back(std::move(req.frame));
+            queued_.pop_front();
+        }
+    }
+
+    std::lock_guard<std::mutex> _(lock_send_);
+    for (auto& frame : frames)
+    {
+        // a failure is recorded by SendBytes, the request then fails on disconnect or timeout
+        SendBytes(sock_, frame.data(), frame.size());
+    }
 }
 
 bool UDSockClient::IsConnected()
@@ -1,17 +1,76 @@
+#ifndef _POLL_CLIENT_
+#define _POLL_CLIENT_
 #include <sys/un.h>
 #include <unistd.h>
 #include <thread>
+#include <atomic>
 #include <mutex>
-#include <map>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <unordered_map>
 #include <functional>
+#include <memory>
 #include "poll_common.h"
+#include "timer_wheel.h"
 
 class UDSockClient : protected SockIO
 {
+public:
+    // completion without a std::function, err is 0 with the response or a negative errno
+    using RawCbk = void (*)(void* ctx, int err, char* data, uint64_t size);
+
+private:
     using OnDisconnct = std::function<void()>;
     using ResponseCbk = std::function<void(char* data, uint64_t size)>;
+    using ChunkCbk = std::function<void(char* data, uint64_t size, bool last)>;
+    using ErrorCbk = std::function<void(int err)>;
+
+    // an idempotent request that later identical requests attach to
+    struct Flight
+    {
+        size_t hash;
+        uint16_t method;
+        std::string key;
+        std::vector<std::pair<ResponseCbk, ErrorCbk>> waiters;
+    };
+
+    struct RequestValue
+    {
+        ResponseCbk cbk;
+        ChunkCbk chunk_cbk;
+        ErrorCbk err_cbk;
+        uint32_t size;
+        TimerNode timer;
+        std::shared_ptr<Flight> flight;
+        RawCbk raw_cbk = nullptr;
+        void* raw_ctx = nullptr;
+    };
+
+    struct QueuedRequest
+    {
+        uint64_t id;
+        RequestValue value;
+        std::string frame;
+    };
 
 public:
+    // what SendRequest does when the in-flight window is full
+    enum WindowPolicy
+    {
+        kWindowBlock,       // wait for responses to free the window. Callbacks run on the receive
+                            // thread, the only one that can free it, their requests are queued instead
+        kWindowFailFast,    // return -EAGAIN
+        kWindowQueue,       // keep the frame, it is sent by the receive thread once the window opens
+    };
+
+    // what SendRequest does while the connection is down
+    enum OfflinePolicy
+    {
+        kOfflineFail,       // return -ENOTCONN
+        kOfflineBuffer,     // keep up to max_buffered frames and send them after reconnecting
+    };
+
     UDSockClient(const int& buffer_size = 5120);
 
     ~UDSockClient();
@@ -22,16 +81,109 @@ public:
 
     int SendRequest(std::string& request, const ResponseCbk& result_cbk);
 
+    // on_error gets a negative errno if the request fails after it was accepted,
+    // -ECONNRESET when the connection drops before the response arrives,
+    // req_id receives the id to pass to Cancel()
+    int SendRequest(uint16_t method, std::string& request, const ResponseCbk& result_cbk, 
+        const ErrorCbk& on_error = nullptr, uint64_t* req_id = nullptr);
+
+    // same as SendRequest with a plain function and context pointer stored in the pending
+    // slot, cbk runs exactly once on success or failure unless an error is returned here
+    int SendRaw(uint16_t method, std::string& request, RawCbk cbk, void* ctx, uint64_t* req_id = nullptr);
+
+    // for requests whose response depends only on method and body: while an identical
+    // request is in flight the caller shares its response instead of sending another frame
+    int SendIdempotent(uint16_t method, std::string& request, const ResponseCbk& result_cbk, 
+        const ErrorCbk& on_error = nullptr);
+
+    // requests served by attaching to one already in flight
+    uint64_t Coalesced();
+
+    // fire-and-forget, the server sends no response frame. Frames carry a sequence of a
+    // random stream owned by this client, a server checking it sees losses per client
+    // and across reconnects
+    int SendOneWay(uint16_t method, std::string& message);
+
+    // for methods registered with RegisterStreamMethod, on_chunk runs once per received piece
+    int SendStreamRequest(uint16_t method, std::string& request, const ChunkCbk& on_chunk, 
+        const ErrorCbk& on_error = nullptr, uint64_t* req_id = nullptr);
+
+    // withdraw a pending request, its on_error gets -ECANCELED and the server skips it
+    // if it has not run yet, -ENOENT when the request already completed
+    int Cancel(uint64_t req_id);
+
+    // on_push runs on the receive thread for every frame the server pushes on topic, it may
+    // subscribe or unsubscribe itself. Subscriptions are sent again after a reconnect
+    int Subscribe(uint16_t topic, const ResponseCbk& on_push);
+
+    int Unsubscribe(uint16_t topic);
+
+    // bound the requests and request bytes in flight, 0 means unlimited, a lower
+    // credit advertised by the server takes precedence over max_requests
+    void SetWindow(uint32_t max_requests, uint64_t max_bytes, WindowPolicy policy);
+
+    uint32_t InFlight();
+
+    void SetOfflinePolicy(OfflinePolicy policy, uint32_t max_buffered);
+
+    // requests without a response for timeout_ms fail with -ETIMEDOUT, 0 disables,
+    // for streamed responses the timeout restarts with every piece
+    void SetTimeout(uint32_t timeout_ms);
+
+    // seal every frame sent with a CRC32C trailer, the server then seals its responses
+    // as well. Frames that fail the check drop the connection. Call before Init()
+    void SetChecksum(bool enable);
+
+    // responses announcing more than max_bytes drop the connection, kMaxFrameSize by
+    // default, requests larger than it fail with -EMSGSIZE
+    void SetMaxFrameSize(uint32_t max_bytes);
+
     void Stop();
 
     bool IsConnected();
 
 protected:
 
-    inline void CleanRequest();
+    // complete every pending request with err
+    void FailPending(int err);
 
+    // a single non-blocking connect attempt, the loop retries with backoff
     bool ConnectServer();
 
+    void Disconnect(int efd, Buffer& buffer);
+
+    inline void QueueFrame(RpcRequestHdr& head, std::string& request, const RequestValue& value);
+
+    static uint64_t NowMs();
+
+    int SendControl(uint16_t flags, uint16_t method, uint64_t id = 0);
+
+    // a header-only frame into frame, sealed when checksums are on, returns its size
+    size_t ControlFrame(char* frame, uint16_t flags, uint16_t method, uint64_t id);
+
+    int DoSend(uint16_t method, std::string& request, RequestValue& value, uint64_t* req_id);
+
+    void HandleFrame(RpcRequestHdr* head, char* data);
+
+    inline bool WindowOpen(uint32_t size);
+
+    inline void ReleaseWindow(const RequestValue& value);
+
+    inline void TrackRequest(uint64_t id, const RequestValue& value);
+
+    inline bool JoinFlight(uint16_t method, std::string& request, RequestValue& value);
+
+    inline void LeaveFlight(uint64_t id, const RequestValue& value);
+
+    static void TakeErrorCbks(RequestValue& value, std::vector<ErrorCbk>& out);
+
+    void ExpireRequests();
+
+    // set the timerfd to the wheel's next tick, disarmed while the wheel is empty, lock_req_ held
+    inline void ArmTimer();
+
+    void FlushQueued();
+
 private:
 
     uint32_t buffer_size_;
@@ -39,9 +191,39 @@ private:
     sockaddr_un addr_;
     OnDisconnct on_disconn_;
     std::mutex lock_send_;
+    uint64_t oneway_seq_;
+    uint64_t oneway_stream_;
+    bool stream_sent_;          // oneway_stream_ announced on the current connection, under lock_send_
     std::thread thread_;
     volatile bool running_;
 
     std::mutex lock_req_;
-    std::map<uint64_t, ResponseCbk> request_;
+    uint64_t request_id_;
+    std::unordered_map<uint64_t, RequestValue> request_;
+    TimerWheel wheel_;
+    int tfd_;
+    uint64_t timer_at_;         // tick the timerfd fires at, 0 when disarmed
+    uint32_t timeout_ms_;
+    std::unordered_multimap<size_t, uint64_t> flights_;
+    uint64_t coalesced_;
+
+    // in-flight window, guarded by lock_req_
+    uint32_t max_inflight_;
+    uint64_t max_inflight_bytes_;
+    uint32_t server_credits_;
+    WindowPolicy window_policy_;
+    std::atomic<uint32_t> inflight_;
+    uint64_t inflight_bytes_;
+    std::condition_variable window_cv_;
+    std::deque<QueuedRequest> queued_;
+    OfflinePolicy offline_policy_;
+    uint32_t max_offline_;
+
+    std::mutex lock_stream_;
+    std::unordered_map<uint16_t, ResponseCbk> streams_;
+
+    uint16_t crc_flag_;         // kFlagCrc or 0, or-ed into every frame sent
+    uint32_t max_frame_size_;
 };
+
+#endif // _POLL_CLIENT_
@@ -0,0 +1,118 @@
+#ifndef _POLL_CLIENT_CORO_
+#define _POLL_CLIENT_CORO_
+#if __cplusplus < 202002L
+#error "poll_client_coro.h needs C++20 coroutines, build with -std=c++20"
+#endif
+#include <coroutine>
+#include <exception>
+#include "poll_client.h"
+
+// outcome of one awaited call, err is 0 or the negative errno SendRequest or on_error reports
+struct CallResult
+{
+    int err;
+    std::string data;
+};
+
+// where a completed call resumes its coroutine, empty resumes it inline on the receive thread.
+// Inline is cheapest, but calls the coroutine makes next are then written by the receive
+// thread: once both socket buffers fill it blocks in write while the server blocks writing
+// responses nobody reads. With more than a few KB in flight pass an executor
+using CoroExecutor = std::function<void(std::coroutine_handle<>)>;
+
+// fire-and-forget coroutine, starts at once and frees its frame when it returns
+struct CoroTask
+{
+    struct promise_type
+    {
+        CoroTask get_return_object() { return CoroTask(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// awaitable calls over a UDSockClient: the awaiter itself is the pending request context,
+// the receive thread hands it the response and resumes the caller, so a call costs a
+// coroutine frame and no thread or std::function of its own
+class CoroClient
+{
+public:
+    class CallAwaiter
+    {
+    public:
+        CallAwaiter(CoroClient& owner, uint16_t method, std::string&& request)
+            : owner_(owner), method_(method), request_(std::move(request))
+        {
+            result_.err = 0;
+        }
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            handle_ = handle;
+            int ret = owner_.client_.SendRaw(method_, request_, &CallAwaiter::OnComplete, this);
+            if (ret < 0)
+            {
+                // never sent, no callback follows
+                result_.err = ret;
+                return false;
+            }
+            // the response may already have resumed the caller on another thread, *this is gone
+            return true;
+        }
+
+        CallResult await_resume()
+        {
+            return std::move(result_);
+        }
+
+    private:
+        static void OnComplete(void* ctx, int err, char* data, uint64_t size)
+        {
+            CallAwaiter* self = static_cast<CallAwaiter*>(ctx);
+            self->result_.err = err;
+            if (err == 0)
+            {
+                // the receive buffer is reused once this returns
+                self->result_.data.assign(data, size);
+            }
+            if (self->owner_.executor_)
+                self->owner_.executor_(self->handle_);
+            else
+                self->handle_.resume();
+        }
+
+        CoroClient& owner_;
+        uint16_t method_;
+        std::string request_;
+        std::coroutine_handle<> handle_;
+        CallResult result_;
+    };
+
+    CoroClient(UDSockClient& client, const CoroExecutor& executor = nullptr)
+        : client_(client), executor_(executor) {}
+
+    // co_await client.Call(method, request), failures come back in CallResult::err,
+    // including -ETIMEDOUT and -ECONNRESET from the underlying client
+    CallAwaiter Call(uint16_t method, std::string request)
+    {
+        return CallAwaiter(*this, method, std::move(request));
+    }
+
+    CallAwaiter Call(std::string request)
+    {
+        return CallAwaiter(*this, 0, std::move(request));
+    }
+
+private:
+    UDSockClient& client_;
+    CoroExecutor executor_;
+};
+
+#endif // _POLL_CLIENT_CORO_
@@ -0,0 +1,167 @@
+#include <errno.h>
+#include <functional>
+#include "poll_client_pool.h"
+
+UDSockClientPool::UDSockClientPool(const int& conn_count, const int& buffer_size, PickPolicy policy)
+    : conn_count_(conn_count > 0 ? conn_count : 1), buffer_size_(buffer_size), policy_(policy), next_(0)
+{
+
+}
+
+UDSockClientPool::~UDSockClientPool()
+{
+    Stop();
+}
+
+bool UDSockClientPool::Init(const std::string& server_addr, const OnDisconnct& on_disconn)
+{
+    for (int i = 0; i < conn_count_; i++)
+    {
+        std::unique_ptr<UDSockClient> client(new UDSockClient(buffer_size_));
+        if (!client->Init(server_addr, on_disconn))
+        {
+            LOG_OUT("pool connect failed, index", std::to_string(i));
+            Stop();
+            return false;
+        }
+        clients_.push_back(std::move(client));
+    }
+    return true;
+}
+
+inline int UDSockClientPool::Pick()
+{
+    if (clients_.empty())
+    {
+        return -1;
+    }
+
+    if (policy_ == kPickThreadAffinity)
+    {
+        static thread_local size_t slot = std::hash<std::thread::id>()(std::this_thread::get_id());
+        return slot % clients_.size();
+    }
+
+    // start the scan at a rotating index so ties do not all land on the first connection
+    size_t n = clients_.size();
+    size_t start = next_.fetch_add(1, std::memory_order_relaxed) % n;
+    size_t best = start;
+    uint32_t best_cnt = clients_[start]->InFlight();
+    for (size_t i = 1; i < n && best_cnt > 0; i++)
+    {
+        size_t idx = (start + i) % n;
+        uint32_t cnt = clients_[idx]->InFlight();
+        if (cnt < best_cnt)
+        {
+            best = idx;
+            best_cnt = cnt;
+        }
+    }
+    return best;
+}
+
+inline uint64_t UDSockClientPool::PoolId(uint64_t id, int idx)
+{
+    return id * clients_.size() + idx;
+}
+
+int UDSockClientPool::SendRequest(std::string& request, const ResponseCbk& result_cbk)
+{
+    return SendRequest(0, request, result_cbk);
+}
+
+int UDSockClientPool::SendRequest(uint16_t method, std::string& request, const ResponseCbk& result_cbk,
+    const ErrorCbk& on_error, uint64_t* req_id)
+{
+    int idx = Pick();
+    if (idx < 0)
+    {
+        return -ENOTCONN;
+    }
+    int ret = clients_[idx]->SendRequest(method, request, result_cbk, on_error, req_id);
+    if (ret == 0 && req_id)
+    {
+        *req_id = PoolId(*req_id, idx);
+    }
+    return ret;
+}
+
+int UDSockClientPool::SendOneWay(uint16_t method, std::string& message)
+{
+    int idx = Pick();
+    return idx < 0 ? -ENOTCONN : clients_[idx]->SendOneWay(method, message);
+}
+
+int UDSockClientPool::SendStreamRequest(uint16_t method, std::string& request, const ChunkCbk& on_chunk,
+    const ErrorCbk& on_error, uint64_t* req_id)
+{
+    int idx = Pick();
+    if (idx < 0)
+    {
+        return -ENOTCONN;
+    }
+    int ret = clients_[idx]->SendStreamRequest(method, request, on_chunk, on_error, req_id);
+    if (ret == 0 && req_id)
+    {
+        *req_id = PoolId(*req_id, idx);
+    }
+    return ret;
+}
+
+int UDSockClientPool::SendIdempotent(uint16_t method, std::string& request, const ResponseCbk& result_cbk,
+    const ErrorCbk& on_error)
+{
+    if (clients_.empty())
+    {
+        return -ENOTCONN;
+    }
+    size_t slot = std::hash<std::string>()(request) ^ method;
+    return clients_[slot % clients_.size()]->SendIdempotent(method, request, result_cbk, on_error);
+}
+
+int UDSockClientPool::Cancel(uint64_t req_id)
+{
+    if (clients_.empty())
+    {
+        return -ENOENT;
+    }
+    size_t n = clients_.size();
+    return clients_[req_id % n]->Cancel(req_id / n);
+}
+
+void UDSockClientPool::SetWindow(uint32_t max_requests, uint64_t max_bytes, UDSockClient::WindowPolicy policy)
+{
+    for (auto& client : clients_)
+    {
+        client->SetWindow(max_requests, max_bytes, policy);
+    }
+}
+
+uint32_t UDSockClientPool::InFlight()
+{
+    uint32_t cnt = 0;
+    for (auto& client : clients_)
+    {
+        cnt += client->InFlight();
+    }
+    return cnt;
+}
+
+void UDSockClientPool::Stop()
+{
+    for (auto& client : clients_)
+    {
+        client->Stop();
+    }
+    clients_.clear();
+}
+
+bool UDSockClientPool::IsConnected()
+{
+    for (auto& client : clients_)
+    {
+        if (client->IsConnected())
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,72 @@
+#ifndef _POLL_CLIENT_POOL_
+#define _POLL_CLIENT_POOL_
+#include <memory>
+#include <vector>
+#include "poll_client.h"
+
+// K connections to one server, each with its own receive thread, behind the
+// same send interface as UDSockClient
+class UDSockClientPool
+{
+    using OnDisconnct = std::function<void()>;
+    using ResponseCbk = std::function<void(char* data, uint64_t size)>;
+    using ChunkCbk = std::function<void(char* data, uint64_t size, bool last)>;
+    using ErrorCbk = std::function<void(int err)>;
+
+public:
+    enum PickPolicy
+    {
+        kPickLeastInFlight, // connection with the fewest pending requests
+        kPickThreadAffinity,// the calling thread always uses the same connection
+    };
+
+    UDSockClientPool(const int& conn_count = 4, const int& buffer_size = 5120, PickPolicy policy = kPickLeastInFlight);
+
+    ~UDSockClientPool();
+
+    bool Init(const std::string& server_addr, const OnDisconnct& on_disconn);
+
+    int SendRequest(std::string& request, const ResponseCbk& result_cbk);
+
+    // on_error and req_id as for UDSockClient, the id names the connection too
+    int SendRequest(uint16_t method, std::string& request, const ResponseCbk& result_cbk,
+        const ErrorCbk& on_error = nullptr, uint64_t* req_id = nullptr);
+
+    int SendOneWay(uint16_t method, std::string& message);
+
+    int SendStreamRequest(uint16_t method, std::string& request, const ChunkCbk& on_chunk,
+        const ErrorCbk& on_error = nullptr, uint64_t* req_id = nullptr);
+
+    // identical requests always go to the same connection so they can be coalesced there
+    int SendIdempotent(uint16_t method, std::string& request, const ResponseCbk& result_cbk,
+        const ErrorCbk& on_error = nullptr);
+
+    // withdraw a request sent through the pool, see UDSockClient::Cancel()
+    int Cancel(uint64_t req_id);
+
+    void SetWindow(uint32_t max_requests, uint64_t max_bytes, UDSockClient::WindowPolicy policy);
+
+    uint32_t InFlight();
+
+    void Stop();
+
+    bool IsConnected();
+
+protected:
+
+    // index of the connection to use, -1 without any
+    inline int Pick();
+
+    // a client request id with the index of its connection
+    inline uint64_t PoolId(uint64_t id, int idx);
+
+private:
+
+    int conn_count_;
+    int buffer_size_;
+    PickPolicy policy_;
+    std::atomic<uint32_t> next_;
+    std::vector<std::unique_ptr<UDSockClient>> clients_;
+};
+
+#endif // _POLL_CLIENT_POOL_
@@ -4,30 +4,101 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <limits.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <cstring>
 #include <assert.h>
 
 #include <signal.h>
+#include "flight_recorder.h"
+#include "buffer_arena.h"
+#include "crc32c.h"
 
 const int kBufferSize = 5120;
 const std::string kServerAddress = "/tmp/unix.sock";
 
 // server configure
 const int kMaxFiles = 1024;
+const int kListenBacklog = 1024;    // capped by net.core.somaxconn
+const int kAcceptBatch = 64;        // connections accepted per listener wakeup
+const int kHandOverDrainMs = 3000;  // a hot restart waits this long for async replies
+const int kMaxMethods = 256;
+const int kMaxBatch = 128;          // frames handed to a batch handler in one call
+const size_t kMaxSeqStreams = 4096; // one-way streams remembered after their connection closed
+const uint64_t kCacheBudget = 64 * 1024 * 1024;    // bytes, response cache default
+const uint64_t kArenaSize = 64 * 1024 * 1024;       // bytes, huge page buffer arena default
+const uint64_t kMaxQueuedOutput = 16 * 1024 * 1024; // bytes waiting for one slow connection before it is dropped
+const int kStreamWorkers = 2;       // threads running stream handlers
 
 // client configure
 const int kReConnectCount = 2;
 const int kReconnectInterval = 1; // s
+const uint32_t kReconnectMinMs = 5;
+const uint32_t kReconnectMaxMs = 1000;
 const uint64_t kCleanTimeoutRequest = 3000; // ms
 
 struct RpcRequestHdr
 {
     uint64_t id;
     uint32_t data_size;
+    uint16_t method;    // handler slot on the server, 0 is the default handler
+    uint16_t flags;
     char data[];
 };
 
+// RpcRequestHdr::flags
+const uint16_t kFlagOneWay = 0x0001;   // no response frame, id carries the sender's one-way sequence
+const uint16_t kFlagSubscribe = 0x0002; // client -> server, method is the topic
+const uint16_t kFlagUnsubscribe = 0x0004;
+const uint16_t kFlagPush = 0x0008;      // server -> client, method is the topic
+const uint16_t kFlagChunk = 0x0010;     // one piece of a streamed response
+const uint16_t kFlagLast = 0x0020;      // final piece, may be empty
+const uint16_t kFlagCredit = 0x0040;    // server -> client, id is the number of requests it accepts in flight
+const uint16_t kFlagCancel = 0x0080;    // client -> server, id is the request to drop, no body
+const uint16_t kFlagCrc = 0x0100;       // the last kCrcSize bytes counted in data_size are the CRC32C
+                                        // of the header and the body before them
+const uint16_t kFlagStream = 0x0200;    // client -> server, id is the random stream its one-way sequence
+                                        // belongs to, sent before the first one-way frame of a connection
+
+const uint32_t kCrcSize = sizeof(uint32_t);
+// frames announcing more are taken for a corrupted stream and the connection is dropped
+const uint32_t kMaxFrameSize = 64 * 1024 * 1024;
+
+// streamed responses are cut into frames of at most this many bytes
+const uint32_t kMaxChunkSize = 32 * 1024;
+// bytes a stream may have waiting for its client before the writer is parked
+const uint32_t kStreamWindow = 8 * kMaxChunkSize;
+
+// seal a frame with kFlagCrc set: data_size grows by the trailer, the returned value goes after the body
+inline uint32_t SealFrame(RpcRequestHdr* head, const void* body, uint32_t size)
+{
+    head->data_size = size + kCrcSize;
+    return Crc32c(body, size, Crc32c(head, sizeof(RpcRequestHdr)));
+}
+
+// check a complete received frame and strip its trailer, data_size is the body size afterwards
+inline bool OpenFrame(RpcRequestHdr* head)
+{
+    if (!(head->flags & kFlagCrc))
+    {
+        return true;
+    }
+    if (head->data_size < kCrcSize)
+    {
+        return false;
+    }
+    uint32_t size = head->data_size - kCrcSize;
+    uint32_t expect;
+    memcpy(&expect, head->data + size, kCrcSize);
+    if (Crc32c(head->data, size, Crc32c(head, sizeof(RpcRequestHdr))) != expect)
+    {
+        return false;
+    }
+    head->data_size = size;
+    return true;
+}
+
 #define CLOSE_FD(fd) \
     do  \
     {   \
@@ -55,6 +126,20 @@ public:
         char* buf = nullptr;
         char* s = nullptr;
         char* e = nullptr;
+        BufferArena* arena = nullptr;
+
+        inline char* Alloc(const int& size)
+        {
+            return arena ? arena->Alloc(size) : new char[size];
+        }
+
+        inline void Free(char* p, const int& size)
+        {
+            if (arena)
+                arena->Free(p, size);
+            else
+                delete[] p;
+        }
     
     public:
         Buffer(const int& size)
@@ -65,9 +150,10 @@ public:
             this->size = size;
         }
 
-        Buffer(const int& size, const int& fd)
+        Buffer(const int& size, const int& fd, BufferArena* arena = nullptr)
         {
-            buf = new char[size];
+            this->arena = arena;
+            buf = Alloc(size);
             s = e = buf;
             this->size = size;
             this->fd = fd;
@@ -146,11 +232,11 @@ public:
         inline void Expand(const int& size)
         {
             int len = DataSize();
-            char* tbuf = new char[size];
+            char* tbuf = Alloc(size);
             memcpy(tbuf, s, len);
             if (buf)
             {
-                delete[] buf;
+                Free(buf, this->size);
             }
             buf = tbuf;
             this->size = size;
@@ -161,7 +247,7 @@ public:
         {
             if(buf)
             {
-                delete[] buf;
+                Free(buf, size);
             }
             buf = nullptr;
             size = 0;
@@ -185,25 +271,92 @@ public:
         return 0;
     }
 
-    int64_t WriteVec(int fd, void* head, int64_t hsize, void* body, int64_t bsize)
+    // a non-blocking socket that is full waits here instead of spinning, so both kinds of
+    // socket block the caller until the peer reads. Never on the server loop, see TryWriteIov()
+    void WaitWritable(int fd)
     {
-        int64_t n = 0;
-        struct iovec iov[2];
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        poll(&pfd, 1, -1);
+    }
+
+    // tail is the CRC trailer of a sealed frame
+    int64_t WriteVec(int fd, void* head, int64_t hsize, void* body, int64_t bsize, void* tail = nullptr, int64_t tsize = 0)
+    {
+        struct iovec iov[3];
         iov[0].iov_base = head;
         iov[0].iov_len = hsize;
         iov[1].iov_base = body;
         iov[1].iov_len = bsize;
+        iov[2].iov_base = tail;
+        iov[2].iov_len = tsize;
+        return WriteIov(fd, iov, tail ? 3 : 2);
+    }
+
+    // gathered write of several frames, iov is advanced past what was written
+    int64_t WriteIov(int fd, struct iovec* iov, int cnt)
+    {
+        int64_t n = 0, total = 0;
+        uint64_t retries = 0;
+        struct iovec* cur = iov;
+        for (int i = 0; i < cnt; i++)
+            total += iov[i].iov_len;
     again:
-        n = writev(fd, iov, 2);
+        n = writev(fd, cur, cnt < IOV_MAX ? cnt : IOV_MAX);
         if (n == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                retries++;
+                WaitWritable(fd);
                 goto again;
-            else
+            }
+            else if (errno == EINTR) {
+                goto again;
+            }
+            else {
+                FlightRecorder::Record(kFlightWriteError, fd, errno);
                 return -1;
+            }
         } else if (n == 0) {
             return -1;
         }
-        assert(n == bsize + hsize);
+        // a non-blocking socket may take part of the frames, go on after the written bytes
+        while (cnt > 0 && (uint64_t)n >= cur->iov_len) {
+            n -= cur->iov_len;
+            cur++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            cur->iov_base = (char*)cur->iov_base + n;
+            cur->iov_len -= n;
+            goto again;
+        }
+        if (retries)
+            FlightRecorder::Record(kFlightWriteAgain, fd, retries);
+        FlightRecorder::Record(kFlightWrite, fd, total);
+        return total;
+    }
+
+    // one gathered write that never waits, for the server loop. Bytes written, which may be
+    // less than asked when the socket is full, or -1 on error
+    int64_t TryWriteIov(int fd, struct iovec* iov, int cnt)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt < IOV_MAX ? cnt : IOV_MAX;
+        int64_t n;
+        do {
+            n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        } while (n == -1 && errno == EINTR);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            FlightRecorder::Record(kFlightWriteError, fd, errno);
+            return -1;
+        }
+        FlightRecorder::Record(kFlightWrite, fd, n);
         return n;
     }
 
@@ -213,10 +366,17 @@ public:
     again:
         n = send(fd, (void*)buff, nbytes, MSG_NOSIGNAL);
         if (n == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                WaitWritable(fd);
                 goto again;
-            else
+            }
+            else if (errno == EINTR) {
+                goto again;
+            }
+            else {
+                FlightRecorder::Record(kFlightWriteError, fd, errno);
                 return -1;
+            }
         } else if (n == 0) {
             return -1;
         }
@@ -1,216 +1,1867 @@
-#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/un.h>
+#include <time.h>
 #include <errno.h>
 #include <assert.h>
 #include <cstring>
 #include "poll_server.h"
+#include "perf_counter.h"
+#include "numa_topology.h"
 
 const int kHeadSize = sizeof(RpcRequestHdr);
 
-UDSockServer::UDSockServer(const int& buffer_size) : lis_sock_(-1), buffer_size_(buffer_size), running_(false)
+// hot restart control stream, old -> new: the listener, one message per connection, then
+// kHandOverEnd; new -> old: one byte once everything arrived. The fd rides on the header,
+// topics (uint16_t each) and the unparsed request bytes follow it
+struct HandOverHdr
 {
+    uint32_t kind;
+    int32_t pid;
+    uint32_t topics;
+    uint32_t size;
+    uint64_t stream;    // one-way stream of the connection, 0 when none was announced
+    uint64_t oneway_next;   // one-way sequence expected next, 0 when unknown
+    uint32_t crc;       // the client seals its frames, pushes to it are sealed too
+    uint32_t pad;
+};
 
+enum HandOverKind
+{
+    kHandOverListen = 1,
+    kHandOverConn,
+    kHandOverEnd,
+};
+
+static bool SendHandOver(int sock, HandOverHdr& hdr, int fd)
+{
+    struct iovec iov;
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd != -1)
+    {
+        memset(ctrl, 0, sizeof(ctrl));
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t n;
+    do
+    {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    return n == sizeof(hdr);
+}
+
+static bool RecvAll(int sock, void* data, size_t size)
+{
+    char* p = reinterpret_cast<char*>(data);
+    while (size > 0)
+    {
+        ssize_t n = recv(sock, p, size, MSG_WAITALL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool RecvHandOver(int sock, HandOverHdr& hdr, int& fd)
+{
+    struct iovec iov;
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    ssize_t n;
+    do
+    {
+        n = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+
+    fd = -1;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (n != sizeof(hdr))
+    {
+        CLOSE_FD(fd);
+        return false;
+    }
+    return true;
+}
+
+UDSockServer::UDSockServer(const int& buffer_size) 
+    : lis_sock_(-1), backlog_(kListenBacklog), buffer_size_(buffer_size), methods_(kMaxMethods), seq_check_(false), 
+    oneway_lost_(0), cancelled_(0), credits_(0), max_frame_size_(kMaxFrameSize), max_queued_(kMaxQueuedOutput), arena_bytes_(0), arena_lock_(false), notify_fd_(-1), stream_workers_(kStreamWorkers), 
+    stream_stop_(false), numa_node_(-1), handed_over_(false), running_(false)
+{
+
+}
+
+UDSockServer::~UDSockServer()
+{
+    for (Connection* buf : inherited_)
+    {
+        delete buf;
+    }
+    for (auto& it : adopted_)
+    {
+        close(it.first);
+    }
+}
+
+bool UDSockServer::Init(const std::string& server_addr, const RequestCbk& on_request)
+{
+    address_ = server_addr;
+    RegisterMethod(0, on_request);
+
+    lis_sock_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (-1 == lis_sock_)
+    {
+        LOG_OUT("socket create failed" , strerror(errno));
+        return false;
+    }
+
+    if (SetNonBlocking(lis_sock_) < 0)
+    {
+        LOG_OUT("SetNonBlocking failed" , strerror(errno));
+        CLOSE_FD(lis_sock_);
+        return false;
+    }
+
+    sockaddr_un server_sockaddr;
+    server_sockaddr.sun_family = AF_UNIX;
+    strcpy(server_sockaddr.sun_path, address_.c_str());
+
+    unlink(address_.c_str());
+
+    if (-1 == bind(lis_sock_, (struct sockaddr*)&server_sockaddr, sizeof(server_sockaddr)))
+    {
+        LOG_OUT("bind failed" , strerror(errno));
+        CLOSE_FD(lis_sock_);
+        unlink(address_.c_str());
+        return false;
+    }
+
+    if (-1 == listen(lis_sock_, backlog_))
+    {
+        LOG_OUT("listen failed" , strerror(errno));
+        CLOSE_FD(lis_sock_);
+        unlink(address_.c_str());
+        return false;
+    }
+
+    // thread_ = std::thread(&UDSockServer::Run, this);
+
+    return true;
+}
+
+void UDSockServer::SetBacklog(int backlog)
+{
+    backlog_ = backlog;
+}
+
+void UDSockServer::EnableBufferArena(uint64_t bytes, bool lock)
+{
+    arena_bytes_ = bytes ? bytes : kArenaSize;
+    arena_lock_ = lock;
+    if (!arena_)
+    {
+        arena_.reset(new BufferArena());
+    }
+}
+
+void UDSockServer::OpenArena()
+{
+    if (!arena_)
+    {
+        return;
+    }
+    if (!arena_->Open(arena_bytes_, arena_lock_))
+    {
+        // buffers come from the heap as before
+        LOG_OUT("buffer arena failed" , strerror(errno));
+    }
+}
+
+bool UDSockServer::GetArenaStats(BufferArena::Stats& stats)
+{
+    if (!arena_)
+    {
+        return false;
+    }
+    arena_->GetStats(stats);
+    return true;
+}
+
+void UDSockServer::EnableHotRestart(const std::string& ctrl_addr)
+{
+    ctrl_address_ = ctrl_addr;
+}
+
+bool UDSockServer::HandedOver()
+{
+    return handed_over_;
+}
+
+bool UDSockServer::TakeOver(const std::string& ctrl_addr, const std::string& server_addr, const RequestCbk& on_request)
+{
+    address_ = server_addr;
+    RegisterMethod(0, on_request);
+
+    int ctrl = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (-1 == ctrl)
+    {
+        LOG_OUT("socket create failed" , strerror(errno));
+        return false;
+    }
+    sockaddr_un ctrl_sockaddr;
+    ctrl_sockaddr.sun_family = AF_UNIX;
+    strcpy(ctrl_sockaddr.sun_path, ctrl_addr.c_str());
+    if (-1 == connect(ctrl, (struct sockaddr*)&ctrl_sockaddr, sizeof(ctrl_sockaddr)))
+    {
+        LOG_OUT("connect hot restart control failed" , strerror(errno));
+        CLOSE_FD(ctrl);
+        return false;
+    }
+
+    // the old loop drains before it answers, this blocks until it is done
+    bool done = false;
+    while (!done)
+    {
+        HandOverHdr hdr;
+        int fd = -1;
+        if (!RecvHandOver(ctrl, hdr, fd))
+        {
+            break;
+        }
+        if (hdr.kind == kHandOverEnd)
+        {
+            done = true;
+            break;
+        }
+        if (fd == -1)
+        {
+            break;
+        }
+        if (hdr.kind == kHandOverListen)
+        {
+            CLOSE_FD(lis_sock_);
+            lis_sock_ = fd;
+            continue;
+        }
+
+        // room for the partial frame and the rest of it. The arena is mapped by the loop in
+        // Serve(), the inherited buffers stay on the heap
+        Connection* buf = new Connection(buffer_size_ + hdr.size, fd);
+        buf->pid = hdr.pid;
+        buf->chan = PushHandle(new PushChannel(this, fd));
+        inherited_.push_back(buf);
+        std::vector<uint16_t> topics(hdr.topics);
+        if (!RecvAll(ctrl, topics.data(), topics.size() * sizeof(uint16_t)) || !RecvAll(ctrl, buf->PitAddr(), hdr.size))
+        {
+            break;
+        }
+        buf->Fill(hdr.size);
+        buf->topics.insert(topics.begin(), topics.end());
+        // not waiting for the next sealed request, a push may go out before it
+        buf->crc = hdr.crc;
+        buf->chan->crc_ = hdr.crc;
+        buf->oneway_next = hdr.oneway_next;
+        if (hdr.stream)
+        {
+            BindStream(buf, hdr.stream);
+            auto seq = oneway_seq_.find(hdr.stream);
+            if (seq != oneway_seq_.end() && hdr.oneway_next > seq->second.next)
+            {
+                seq->second.next = hdr.oneway_next;
+            }
+        }
+    }
+
+    char ack = 1;
+    if (!done || SendBytes(ctrl, &ack, 1) == -1)
+    {
+        // the old process goes on serving, it still holds every connection
+        LOG_OUT("hot restart take over failed", "");
+        CLOSE_FD(ctrl);
+        CLOSE_FD(lis_sock_);
+        for (Connection* buf : inherited_)
+        {
+            delete buf;
+        }
+        inherited_.clear();
+        return false;
+    }
+    CLOSE_FD(ctrl);
+    if (lis_sock_ == -1)
+    {
+        LOG_OUT("hot restart got no listener", "");
+        return false;
+    }
+    return true;
+}
+
+int UDSockServer::OpenCtrl()
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (-1 == fd)
+    {
+        return -1;
+    }
+    sockaddr_un ctrl_sockaddr;
+    ctrl_sockaddr.sun_family = AF_UNIX;
+    strcpy(ctrl_sockaddr.sun_path, ctrl_address_.c_str());
+    // a process that took over rebinds the path its predecessor listened on
+    unlink(ctrl_address_.c_str());
+    if (-1 == bind(fd, (struct sockaddr*)&ctrl_sockaddr, sizeof(ctrl_sockaddr)) || -1 == listen(fd, 1))
+    {
+        CLOSE_FD(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool UDSockServer::Drain(std::unordered_map<int, Connection*>& conn)
+{
+    bool drained = true;
+    for (auto it = conn.begin(); it != conn.end(); it++)
+    {
+        PushChannel* chan = it->second->chan.get();
+        if (!chan)
+        {
+            continue;
+        }
+        // nothing is watched any more, every round writes what the sockets take
+        std::lock_guard<std::mutex> _(chan->lock_);
+        if (!chan->closed_ && !chan->overflow_)
+        {
+            WriteOut(chan);
+        }
+        if (!chan->deferred_.empty() || !chan->out_.empty())
+        {
+            drained = false;
+        }
+    }
+    return drained;
+}
+
+bool UDSockServer::HandOver(int ctrl, std::unordered_map<int, Connection*>& conn, uint64_t drain_us)
+{
+    HandOverHdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.kind = kHandOverListen;
+    if (!SendHandOver(ctrl, hdr, lis_sock_))
+    {
+        return false;
+    }
+
+    uint64_t handed = 0;
+    for (auto it = conn.begin(); it != conn.end(); it++)
+    {
+        Connection* buf = it->second;
+        if (!buf->chan)
+        {
+            continue;
+        }
+        bool queued = false;
+        {
+            std::lock_guard<std::mutex> _(buf->chan->lock_);
+            queued = !buf->chan->out_.empty();
+        }
+        if (queued)
+        {
+            // output it still owes, maybe half a frame, cannot follow it, the client reconnects
+            shutdown(buf->Fd(), SHUT_RDWR);
+            continue;
+        }
+        std::vector<uint16_t> topics(buf->topics.begin(), buf->topics.end());
+        hdr.kind = kHandOverConn;
+        hdr.pid = buf->pid;
+        hdr.topics = topics.size();
+        hdr.size = buf->DataSize();
+        hdr.stream = buf->stream;
+        hdr.oneway_next = buf->oneway_next;
+        auto seq = buf->stream ? oneway_seq_.find(buf->stream) : oneway_seq_.end();
+        if (seq != oneway_seq_.end())
+        {
+            hdr.oneway_next = seq->second.next;
+        }
+        hdr.crc = buf->crc;
+        if (!SendHandOver(ctrl, hdr, buf->Fd()) ||
+            (!topics.empty() && SendBytes(ctrl, (const char*)topics.data(), topics.size() * sizeof(uint16_t)) == -1) ||
+            (hdr.size && SendBytes(ctrl, buf->DataAddr(), hdr.size) == -1))
+        {
+            return false;
+        }
+        handed++;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.kind = kHandOverEnd;
+    char ack = 0;
+    if (!SendHandOver(ctrl, hdr, -1) || !RecvAll(ctrl, &ack, 1))
+    {
+        return false;
+    }
+    FlightRecorder::Record(kFlightHandOver, ctrl, handed, drain_us);
+    return true;
+}
+
+bool UDSockServer::RegisterMethod(uint16_t method, const RequestCbk& on_request)
+{
+    if (method >= kMaxMethods || running_)
+    {
+        return false;
+    }
+    methods_[method].cbk = on_request;
+    methods_[method].ctx = &methods_[method].cbk;
+    // an empty callback leaves the method without a handler, Dispatch() answers it empty
+    methods_[method].invoke = on_request ? &UDSockServer::InvokeCbk : nullptr;
+    return true;
+}
+
+bool UDSockServer::SetMethod(uint16_t method, MethodInvoker invoke, void* ctx)
+{
+    if (method >= kMaxMethods || running_)
+    {
+        return false;
+    }
+    methods_[method].cbk = nullptr;
+    methods_[method].ctx = ctx;
+    methods_[method].invoke = invoke;
+    return true;
+}
+
+bool UDSockServer::RegisterStreamMethod(uint16_t method, const StreamCbk& on_request)
+{
+    if (method >= kMaxMethods || running_)
+    {
+        return false;
+    }
+    methods_[method].stream = on_request;
+    return true;
+}
+
+void UDSockServer::SetStreamWorkers(int workers)
+{
+    stream_workers_ = workers > 0 ? workers : 1;
+}
+
+bool UDSockServer::RegisterAsyncMethod(uint16_t method, const AsyncCbk& on_request)
+{
+    if (method >= kMaxMethods || running_)
+    {
+        return false;
+    }
+    methods_[method].async = on_request;
+    // a synchronous handler left on the slot, e.g. the empty one of Init(addr, nullptr),
+    // would still serve unknown methods falling back to method 0
+    if (on_request)
+    {
+        methods_[method].cbk = nullptr;
+        methods_[method].ctx = nullptr;
+        methods_[method].invoke = nullptr;
+    }
+    return true;
+}
+
+bool UDSockServer::RegisterBatchMethod(uint16_t method, const BatchCbk& on_batch)
+{
+    if (method >= kMaxMethods || running_)
+    {
+        return false;
+    }
+    methods_[method].batch = on_batch;
+    return true;
+}
+
+bool UDSockServer::SetCacheable(uint16_t method, uint32_t ttl_ms)
+{
+    if (method >= kMaxMethods || running_)
+    {
+        return false;
+    }
+    if (!cache_)
+    {
+        cache_.reset(new ResponseCache(kCacheBudget));
+    }
+    methods_[method].cacheable = true;
+    methods_[method].cache_ttl_ms = ttl_ms;
+    return true;
+}
+
+void UDSockServer::SetCacheBudget(uint64_t bytes)
+{
+    if (!running_)
+    {
+        cache_.reset(new ResponseCache(bytes));
+    }
+}
+
+void UDSockServer::InvalidateCache(uint16_t method)
+{
+    if (cache_)
+    {
+        cache_->Invalidate(method);
+    }
+}
+
+void UDSockServer::InvalidateCache(uint16_t method, const std::string& request)
+{
+    if (cache_)
+    {
+        cache_->Invalidate(method, request.data(), request.size());
+    }
+}
+
+bool UDSockServer::GetCacheStats(ResponseCache::Stats& stats)
+{
+    if (!cache_)
+    {
+        return false;
+    }
+    cache_->GetStats(stats);
+    return true;
+}
+
+bool UDSockServer::GetMethodStats(uint16_t method, MethodStats& stats)
+{
+    if (method >= kMaxMethods || (!methods_[method].invoke && !methods_[method].stream && !methods_[method].async && !methods_[method].batch))
+    {
+        return false;
+    }
+    stats.calls = methods_[method].calls.load(std::memory_order_relaxed);
+    stats.total_ns = methods_[method].total_ns.load(std::memory_order_relaxed);
+    stats.max_ns = methods_[method].max_ns.load(std::memory_order_relaxed);
+    return true;
+}
+
+inline std::string UDSockServer::Dispatch(uint16_t method, char* data, uint64_t size)
+{
+    // unknown methods fall back to the default handler given to Init()
+    MethodEntry& entry = (method < kMaxMethods && methods_[method].invoke) ? methods_[method] : methods_[0];
+    if (!entry.invoke)
+    {
+        return std::string();
+    }
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    std::string resp = entry.invoke(entry.ctx, data, size);
+    FlightRecorder::Record(kFlightHandler, -1, method, RecordCost(entry, begin));
+    return resp;
+}
+
+inline uint64_t UDSockServer::RecordCost(MethodEntry& entry, const struct timespec& begin)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t cost = (end.tv_sec - begin.tv_sec) * 1000000000ULL + end.tv_nsec - begin.tv_nsec;
+    entry.calls.fetch_add(1, std::memory_order_relaxed);
+    entry.total_ns.fetch_add(cost, std::memory_order_relaxed);
+    if (cost > entry.max_ns.load(std::memory_order_relaxed))
+    {
+        entry.max_ns.store(cost, std::memory_order_relaxed);
+    }
+    return cost;
+}
+
+void UDSockServer::RecordReply(uint16_t method, const struct timespec& begin)
+{
+    FlightRecorder::Record(kFlightHandler, -1, method, RecordCost(methods_[method], begin));
+}
+
+void UDSockServer::DispatchStream(Connection* buf, RpcRequestHdr* head)
+{
+    // pending until the worker is done, a cancel frame marks it like an async request
+    {
+        std::lock_guard<std::mutex> _(buf->chan->lock_);
+        buf->chan->deferred_[head->id] = false;
+    }
+    StreamJob job;
+    job.chan = buf->chan;
+    job.id = head->id;
+    job.method = head->method;
+    job.request.assign(buf->DataAddr() + kHeadSize, head->data_size);
+    {
+        std::lock_guard<std::mutex> _(lock_stream_);
+        stream_jobs_.push_back(std::move(job));
+    }
+    stream_cv_.notify_one();
+}
+
+void UDSockServer::StreamWorker()
+{
+    if (numa_node_ >= 0)
+    {
+        NumaTopology::Get().BindThread(numa_node_);
+    }
+    std::unique_lock<std::mutex> lock(lock_stream_);
+    while (true)
+    {
+        stream_cv_.wait(lock, [this]() { return stream_stop_ || !stream_jobs_.empty(); });
+        if (stream_stop_)
+        {
+            break;
+        }
+        StreamJob job = std::move(stream_jobs_.front());
+        stream_jobs_.pop_front();
+        lock.unlock();
+
+        MethodEntry& entry = methods_[job.method];
+        ChunkWriter writer(job.chan, job.id, job.method);
+        if (writer.Cancelled())
+        {
+            // withdrawn while it waited for a worker
+            cancelled_.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            struct timespec begin;
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            entry.stream(&job.request[0], job.request.size(), writer);
+            FlightRecorder::Record(kFlightHandler, -1, job.method, RecordCost(entry, begin));
+            writer.SendFrame(nullptr, 0, kFlagChunk | kFlagLast);
+        }
+        {
+            std::lock_guard<std::mutex> _(job.chan->lock_);
+            job.chan->deferred_.erase(job.id);
+        }
+        lock.lock();
+    }
+}
+
+void UDSockServer::StopStreamWorkers()
+{
+    {
+        std::lock_guard<std::mutex> _(lock_stream_);
+        stream_stop_ = true;
+        // their channels are closed, nobody waits for them any more
+        stream_jobs_.clear();
+    }
+    stream_cv_.notify_all();
+    for (auto& thread : stream_threads_)
+    {
+        thread.join();
+    }
+    stream_threads_.clear();
+}
+
+void UDSockServer::DispatchAsync(Connection* buf, RpcRequestHdr* head)
+{
+    bool oneway = head->flags & kFlagOneWay;
+    if (oneway && seq_check_)
+    {
+        CheckSeq(buf, head->id);
+    }
+    if (!oneway)
+    {
+        std::lock_guard<std::mutex> _(buf->chan->lock_);
+        buf->chan->deferred_[head->id] = false;
+    }
+    Responder responder(buf->chan, head->id, head->method, oneway);
+    methods_[head->method].async(buf->DataAddr() + kHeadSize, head->data_size, responder);
+}
+
+bool UDSockServer::FlushBatch(Connection* buf)
+{
+    size_t count = batch_.size();
+    if (!count)
+    {
+        return true;
+    }
+    uint16_t method = batch_[0].method;
+    MethodEntry& entry = methods_[method];
+    batch_resps_.resize(count);
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    entry.batch(batch_.data(), count, batch_resps_.data());
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t cost = (end.tv_sec - begin.tv_sec) * 1000000000ULL + end.tv_nsec - begin.tv_nsec;
+    entry.calls.fetch_add(count, std::memory_order_relaxed);
+    entry.total_ns.fetch_add(cost, std::memory_order_relaxed);
+    if (cost > entry.max_ns.load(std::memory_order_relaxed))
+    {
+        entry.max_ns.store(cost, std::memory_order_relaxed);
+    }
+    FlightRecorder::Record(kFlightHandler, -1, method, cost);
+
+    // the iovecs point into batch_heads_ and batch_crcs_, size them before taking addresses
+    batch_crcs_.resize(count);
+    batch_iov_.clear();
+    for (size_t i = 0; i < count; i++)
+    {
+        RpcRequestHdr& head = batch_heads_[i];
+        if (head.flags & kFlagOneWay)
+        {
+            continue;
+        }
+        std::string& resp = batch_resps_[i];
+        head.data_size = resp.size();
+        bool sealed = head.flags & kFlagCrc;
+        if (sealed)
+        {
+            batch_crcs_[i] = SealFrame(&head, resp.c_str(), resp.size());
+        }
+        struct iovec iov;
+        iov.iov_base = &head;
+        iov.iov_len = kHeadSize;
+        batch_iov_.push_back(iov);
+        iov.iov_base = (void*)resp.c_str();
+        iov.iov_len = resp.size();
+        batch_iov_.push_back(iov);
+        if (sealed)
+        {
+            iov.iov_base = &batch_crcs_[i];
+            iov.iov_len = kCrcSize;
+            batch_iov_.push_back(iov);
+        }
+    }
+
+    bool ok = true;
+    if (!batch_iov_.empty())
+    {
+        ok = WriteFrames(buf, batch_iov_.data(), batch_iov_.size()) != -1;
+    }
+    batch_.clear();
+    batch_heads_.clear();
+    for (size_t i = 0; i < count; i++)
+    {
+        // keep the capacity for the next batch
+        batch_resps_[i].clear();
+    }
+    return ok;
+}
+
+int UDSockServer::Responder::Reply(const std::string& data)
+{
+    if (!chan_)
+    {
+        return -EINVAL;
+    }
+    UDSockServer* server = chan_->server_;
+    if (oneway_)
+    {
+        server->RecordReply(method_, begin_);
+        return 0;
+    }
+
+    RpcRequestHdr head;
+    head.id = id_;
+    head.data_size = data.size();
+    head.method = method_;
+    head.flags = 0;
+
+    int ret = 0;
+    bool notify = false;
+    {
+        std::lock_guard<std::mutex> _(chan_->lock_);
+        auto it = chan_->deferred_.find(id_);
+        if (chan_->closed_)
+        {
+            return -EPIPE;
+        }
+        if (it == chan_->deferred_.end())
+        {
+            return -EALREADY;
+        }
+        // a cancelled request was already failed by the client, a response would be dropped there
+        ret = it->second ? -ECANCELED : 0;
+        chan_->deferred_.erase(it);
+        if (ret == 0)
+        {
+            ret = chan_->Append(head, data.c_str(), data.size(), &notify);
+        }
+    }
+    server->RecordReply(method_, begin_);
+    if (notify)
+    {
+        server->NotifyPush(chan_);
+    }
+    return ret;
+}
+
+bool UDSockServer::Responder::Cancelled()
+{
+    if (!chan_ || oneway_)
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> _(chan_->lock_);
+    auto it = chan_->deferred_.find(id_);
+    return chan_->closed_ || (it != chan_->deferred_.end() && it->second);
+}
+
+int UDSockServer::ChunkWriter::SendFrame(const char* data, uint32_t size, uint16_t flags)
+{
+    if (failed_)
+    {
+        return -EPIPE;
+    }
+
+    RpcRequestHdr head;
+    head.id = id_;
+    head.data_size = size;
+    head.method = method_;
+    head.flags = flags;
+
+    int ret = 0;
+    bool notify = false;
+    {
+        std::unique_lock<std::mutex> lock(chan_->lock_);
+        // parked here while the client is slow, the loop wakes it as the queue drains
+        chan_->writable_.wait(lock, [this]() { 
+            auto it = chan_->deferred_.find(id_);
+            return chan_->closed_ || chan_->overflow_ || chan_->Queued() < kStreamWindow || 
+                (it != chan_->deferred_.end() && it->second);
+        });
+        auto it = chan_->deferred_.find(id_);
+        if (chan_->closed_)
+            ret = -EPIPE;
+        else if (it != chan_->deferred_.end() && it->second)
+            ret = -ECANCELED;
+        else
+            ret = chan_->Append(head, data, size, &notify);
+    }
+    if (notify)
+    {
+        chan_->server_->NotifyPush(chan_);
+    }
+    if (ret < 0)
+    {
+        failed_ = true;
+        return ret;
+    }
+    sent_ += size;
+    return 0;
+}
+
+int UDSockServer::ChunkWriter::Write(const char* data, uint64_t size)
+{
+    while (size > 0)
+    {
+        if (Cancelled())
+        {
+            failed_ = true;
+            return -ECANCELED;
+        }
+        uint32_t len = size > kMaxChunkSize ? kMaxChunkSize : size;
+        int ret = SendFrame(data, len, kFlagChunk);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        data += len;
+        size -= len;
+    }
+    return 0;
+}
+
+bool UDSockServer::ChunkWriter::Cancelled()
+{
+    if (failed_)
+    {
+        return true;
+    }
+    // the loop marks it when the cancel frame arrives
+    std::lock_guard<std::mutex> _(chan_->lock_);
+    auto it = chan_->deferred_.find(id_);
+    if (chan_->closed_ || (it != chan_->deferred_.end() && it->second))
+    {
+        failed_ = true;
+    }
+    return failed_;
+}
+
+void UDSockServer::EnableSeqCheck(const SeqGapCbk& on_gap)
+{
+    on_seq_gap_ = on_gap;
+    seq_check_ = true;
+}
+
+uint64_t UDSockServer::OneWayLost()
+{
+    return oneway_lost_.load(std::memory_order_relaxed);
+}
+
+uint64_t UDSockServer::CancelledRequests()
+{
+    return cancelled_.load(std::memory_order_relaxed);
+}
+
+inline void UDSockServer::CheckSeq(Connection* conn, uint64_t seq)
+{
+    // keyed by the client's stream so that frames lost across a reconnect are noticed too,
+    // several clients in one process each have their own. Without a stream, per connection
+    uint64_t* next = &conn->oneway_next;
+    if (conn->stream)
+    {
+        auto it = oneway_seq_.find(conn->stream);
+        if (it != oneway_seq_.end())
+        {
+            next = &it->second.next;
+        }
+    }
+    if (*next && seq > *next)
+    {
+        oneway_lost_.fetch_add(seq - *next, std::memory_order_relaxed);
+        if (on_seq_gap_)
+        {
+            on_seq_gap_(conn->pid, *next, seq);
+        }
+    }
+    *next = seq + 1;
+}
+
+void UDSockServer::BindStream(Connection* conn, uint64_t stream)
+{
+    if (conn->stream == stream)
+    {
+        return;
+    }
+    ReleaseStream(conn);
+    conn->stream = stream;
+    if (!seq_check_)
+    {
+        return;
+    }
+    if (oneway_seq_.size() >= kMaxSeqStreams)
+    {
+        // forget streams no connection carries, their clients are most likely gone
+        for (auto it = oneway_seq_.begin(); it != oneway_seq_.end();)
+        {
+            if (it->second.conns == 0)
+                it = oneway_seq_.erase(it);
+            else
+                it++;
+        }
+    }
+    // a stream seen before keeps its expected sequence
+    auto res = oneway_seq_.insert(std::make_pair(stream, SeqStream{0, 0}));
+    res.first->second.conns++;
+}
+
+void UDSockServer::ReleaseStream(Connection* conn)
+{
+    if (!conn->stream)
+    {
+        return;
+    }
+    auto it = oneway_seq_.find(conn->stream);
+    if (it != oneway_seq_.end() && it->second.conns > 0)
+    {
+        it->second.conns--;
+    }
+    conn->stream = 0;
+}
+
+void UDSockServer::SetMaxFrameSize(uint32_t max_bytes)
+{
+    max_frame_size_ = max_bytes;
+}
+
+void UDSockServer::SetMaxQueuedOutput(uint64_t bytes)
+{
+    max_queued_ = bytes;
+}
+
+void UDSockServer::SetCredits(uint32_t credits)
+{
+    credits_ = credits;
+}
+
+void UDSockServer::SetSubscribeCbk(const SubscribeCbk& on_subscribe)
+{
+    on_subscribe_ = on_subscribe;
+}
+
+int UDSockServer::PushChannel::Push(uint16_t topic, const std::string& data)
+{
+    RpcRequestHdr head;
+    head.id = 0;
+    head.data_size = data.size();
+    head.method = topic;
+    head.flags = kFlagPush;
+
+    int ret = 0;
+    bool notify = false;
+    {
+        std::lock_guard<std::mutex> _(lock_);
+        if (closed_)
+        {
+            return -EPIPE;
+        }
+        ret = Append(head, data.c_str(), data.size(), &notify);
+    }
+    if (notify)
+    {
+        server_->NotifyPush(shared_from_this());
+    }
+    return ret;
+}
+
+bool UDSockServer::PushChannel::Alive()
+{
+    std::lock_guard<std::mutex> _(lock_);
+    return !closed_ && !overflow_;
+}
+
+void UDSockServer::PushChannel::Close()
+{
+    std::lock_guard<std::mutex> _(lock_);
+    closed_ = true;
+    out_.clear();
+    out_pos_ = 0;
+    deferred_.clear();
+    writable_.notify_all();
+}
+
+int UDSockServer::PushChannel::Append(RpcRequestHdr head, const char* data, uint64_t size, bool* notify)
+{
+    uint32_t crc = 0;
+    if (crc_)
+    {
+        head.flags |= kFlagCrc;
+        crc = SealFrame(&head, data, size);
+    }
+    struct iovec iov[3];
+    iov[0].iov_base = &head;
+    iov[0].iov_len = kHeadSize;
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = size;
+    iov[2].iov_base = &crc;
+    iov[2].iov_len = kCrcSize;
+    return Queue(iov, crc_ ? 3 : 2, notify);
+}
+
+int UDSockServer::PushChannel::Queue(const struct iovec* iov, int cnt, bool* notify)
+{
+    if (overflow_)
+    {
+        return -ENOBUFS;
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < cnt; i++)
+    {
+        total += iov[i].iov_len;
+    }
+    // a single frame larger than the limit still goes out when nothing else waits
+    if (Queued() && Queued() + total > server_->max_queued_)
+    {
+        FlightRecorder::Record(kFlightOutOverflow, fd_, Queued());
+        overflow_ = true;
+        *notify = true;
+        return -ENOBUFS;
+    }
+    // frames queued before the loop gets to this channel go out in one write
+    for (int i = 0; i < cnt; i++)
+    {
+        out_.append((const char*)iov[i].iov_base, iov[i].iov_len);
+    }
+    if (!armed_)
+    {
+        armed_ = true;
+        *notify = true;
+    }
+    return 0;
+}
+
+void UDSockServer::NotifyPush(const PushHandle& chan)
+{
+    {
+        std::lock_guard<std::mutex> _(lock_push_);
+        push_ready_.push_back(chan);
+    }
+    uint64_t one = 1;
+    if (notify_fd_ != -1 && write(notify_fd_, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    {
+        perror("notify push");
+    }
+}
+
+template <typename Backend>
+void UDSockServer::FlushPush(Backend& backend, std::unordered_map<int, Connection*>& conn)
+{
+    std::vector<PushHandle> ready;
+    {
+        std::lock_guard<std::mutex> _(lock_push_);
+        ready.swap(push_ready_);
+    }
+    for (auto& chan : ready)
+    {
+        // a closed channel's fd may already belong to a new connection
+        auto it = conn.find(chan->fd_);
+        if (it != conn.end() && it->second->chan == chan)
+        {
+            FlushOut(backend, it->second);
+        }
+    }
+}
+
+template <typename Backend>
+void UDSockServer::FlushOut(Backend& backend, Connection* buf)
+{
+    PushChannel* chan = buf->chan.get();
+    std::lock_guard<std::mutex> _(chan->lock_);
+    if (chan->closed_)
+    {
+        return;
+    }
+    if (chan->overflow_)
+    {
+        // the hang-up that follows closes the connection
+        std::string().swap(chan->out_);
+        chan->out_pos_ = 0;
+        chan->writable_.notify_all();
+        shutdown(buf->Fd(), SHUT_RDWR);
+        return;
+    }
+    bool drained = WriteOut(chan);
+    if (drained == chan->blocked_)
+    {
+        chan->blocked_ = !drained;
+        backend.WatchOutput(buf->Fd(), buf, chan->blocked_);
+    }
 }
 
-UDSockServer::~UDSockServer()
+bool UDSockServer::WriteOut(PushChannel* chan)
 {
+    while (chan->out_pos_ < chan->out_.size())
+    {
+        ssize_t n = send(chan->fd_, chan->out_.data() + chan->out_pos_, chan->out_.size() - chan->out_pos_, 
+            MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            chan->out_pos_ += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            FlightRecorder::Record(kFlightOutBlocked, chan->fd_, chan->Queued());
+            // a parked stream writer may go on when the window has room again
+            chan->writable_.notify_all();
+            // drop the written head once it is most of the queue, copying stays linear
+            if (chan->out_pos_ > chan->out_.size() / 2)
+            {
+                chan->out_.erase(0, chan->out_pos_);
+                chan->out_pos_ = 0;
+            }
+            return false;
+        }
+        // the connection is closed on its hang-up
+        FlightRecorder::Record(kFlightWriteError, chan->fd_, errno);
+        break;
+    }
+    if (chan->out_pos_)
+    {
+        FlightRecorder::Record(kFlightWrite, chan->fd_, chan->out_pos_);
+    }
+    chan->out_.clear();
+    chan->out_pos_ = 0;
+    chan->armed_ = false;
+    chan->writable_.notify_all();
+    return true;
 }
 
-bool UDSockServer::Init(const std::string& server_addr, const RequestCbk& on_request)
+int64_t UDSockServer::WriteFrames(Connection* buf, struct iovec* iov, int cnt)
 {
-    address_ = server_addr;
-    on_request_ = on_request;
+    PushChannel* chan = buf->chan.get();
+    int64_t n = 0;
+    bool notify = false;
+    {
+        std::lock_guard<std::mutex> _(chan->lock_);
+        if (chan->out_.empty())
+        {
+            n = TryWriteIov(buf->Fd(), iov, cnt);
+            if (n == -1)
+            {
+                return -1;
+            }
+            // skip what the socket took
+            uint64_t left = n;
+            while (cnt > 0 && left >= iov->iov_len)
+            {
+                left -= iov->iov_len;
+                iov++;
+                cnt--;
+            }
+            if (cnt == 0)
+            {
+                return n;
+            }
+            iov->iov_base = (char*)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+        // the rest goes behind what is queued, so frames never interleave, and the loop
+        // writes it once the client reads again
+        if (chan->Queue(iov, cnt, &notify) < 0)
+        {
+            shutdown(buf->Fd(), SHUT_RDWR);
+            errno = ENOBUFS;
+            return -1;
+        }
+    }
+    if (notify)
+    {
+        NotifyPush(buf->chan);
+    }
+    return n;
+}
 
-    lis_sock_ = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (-1 == lis_sock_)
+void UDSockServer::HandleControl(Connection* buf, RpcRequestHdr* head)
+{
+    if (head->flags & kFlagStream)
     {
-        LOG_OUT("socket create failed" , strerror(errno));
-        return false;
+        BindStream(buf, head->id);
+        return;
+    }
+    if (head->flags & (kFlagSubscribe | kFlagUnsubscribe))
+    {
+        if (head->flags & kFlagSubscribe)
+            buf->topics.insert(head->method);
+        else
+            buf->topics.erase(head->method);
+        if (on_subscribe_)
+        {
+            on_subscribe_(head->method, buf->chan, head->flags & kFlagSubscribe);
+        }
     }
+}
 
-    if (SetNonBlocking(lis_sock_) < 0)
+void UDSockServer::ScanCancel(Connection* buf)
+{
+    // a cancel frame always follows the request it targets, so looking ahead over the
+    // complete frames received so far finds every queued request that was withdrawn
+    char* data = buf->DataAddr();
+    int64_t size = buf->DataSize();
+    int64_t pos = 0;
+    while (size - pos >= kHeadSize)
     {
-        LOG_OUT("SetNonBlocking failed" , strerror(errno));
-        CLOSE_FD(lis_sock_);
-        return false;
+        RpcRequestHdr* head = reinterpret_cast<RpcRequestHdr*>(data + pos);
+        if (head->flags & kFlagCancel)
+        {
+            buf->cancelled.insert(head->id);
+        }
+        pos += kHeadSize + head->data_size;
     }
+}
 
-    sockaddr_un server_sockaddr;
-    server_sockaddr.sun_family = AF_UNIX;
-    strcpy(server_sockaddr.sun_path, address_.c_str());
+bool UDSockServer::HandleRead(Connection* buf)
+{
+    int bytes = RecvData(buf->Fd(), buf->PitAddr(), buf->PitSize());
+    // std::cout << "1 fd: " << buf->Fd() << " pid_size: " << buf->PitSize() << " data_size: " << buf->DataSize() << " bytes: " << bytes  << std::endl;
+    if (bytes > 0)
+    {
+        uint32_t frames = 0;
+        FlightRecorder::Record(kFlightRead, buf->Fd(), bytes);
+        buf->Fill(bytes);
+        ScanCancel(buf);
+        // std::cout << "2 fd: " << buf->Fd() << " pid_size: " << buf->PitSize() << " data_size: " << buf->DataSize() << " bytes: " << bytes  << std::endl;
+        while(buf->DataSize() >= kHeadSize)
+        {
+            RpcRequestHdr* head = reinterpret_cast<RpcRequestHdr*>(buf->DataAddr());
+            if (head->data_size > max_frame_size_)
+            {
+                DropBadFrame(buf, head, false);
+                break;
+            }
+            int32_t total_size = head->data_size + kHeadSize;
+            if (total_size > buf->Size())
+            {
+                // a pending batch points into the buffer that is about to move
+                if (!FlushBatch(buf))
+                {
+                    buf->ResetPos();
+                    break;
+                }
+                buf->Expand(total_size + 2 * kHeadSize);
+            }
+            if (total_size <= buf->DataSize())
+            {
+                if (!OpenFrame(head))
+                {
+                    DropBadFrame(buf, head, true);
+                    break;
+                }
+                if ((head->flags & kFlagCrc) && !buf->crc)
+                {
+                    buf->crc = true;
+                    std::lock_guard<std::mutex> _(buf->chan->lock_);
+                    buf->chan->crc_ = true;
+                }
+                frames++;
+                // std::cout << "3 fd: " << buf->Fd() << " total_size: " << total_size << " pid_size: " << buf->PitSize() << " data_size: " << buf->DataSize() << " bytes: " << bytes  << std::endl;
+                if (head->flags & kFlagCancel)
+                {
+                    // its request, if still queued, was skipped earlier in this loop,
+                    // an async one already running sees it through Responder::Cancelled()
+                    buf->cancelled.erase(head->id);
+                    {
+                        std::lock_guard<std::mutex> _(buf->chan->lock_);
+                        auto it = buf->chan->deferred_.find(head->id);
+                        if (it != buf->chan->deferred_.end())
+                        {
+                            it->second = true;
+                            buf->chan->writable_.notify_all();
+                        }
+                    }
+                    buf->Dig(total_size);
+                    continue;
+                }
 
-    unlink(address_.c_str());
+                if (head->flags & (kFlagSubscribe | kFlagUnsubscribe | kFlagStream))
+                {
+                    HandleControl(buf, head);
+                    buf->Dig(total_size);
+                    continue;
+                }
 
-    if (-1 == bind(lis_sock_, (struct sockaddr*)&server_sockaddr, sizeof(server_sockaddr)))
+                if (!buf->cancelled.empty() && !(head->flags & kFlagOneWay) && buf->cancelled.count(head->id))
+                {
+                    cancelled_.fetch_add(1, std::memory_order_relaxed);
+                    buf->Dig(total_size);
+                    continue;
+                }
+
+                if (head->method < kMaxMethods && methods_[head->method].async)
+                {
+                    PERF_PHASE(kPhaseHandler);
+                    DispatchAsync(buf, head);
+                    PERF_PHASE(kPhaseParse);
+                    buf->Dig(total_size);
+                    continue;
+                }
+
+                if (head->method < kMaxMethods && methods_[head->method].batch)
+                {
+                    if ((!batch_.empty() && batch_[0].method != head->method) || batch_.size() >= (size_t)kMaxBatch)
+                    {
+                        PERF_PHASE(kPhaseHandler);
+                        bool ok = FlushBatch(buf);
+                        PERF_PHASE(kPhaseParse);
+                        if (!ok)
+                        {
+                            buf->ResetPos();
+                            break;
+                        }
+                    }
+                    bool oneway = head->flags & kFlagOneWay;
+                    if (oneway && seq_check_)
+                    {
+                        CheckSeq(buf, head->id);
+                    }
+                    RequestView view;
+                    view.id = head->id;
+                    view.method = head->method;
+                    view.oneway = oneway;
+                    view.data = buf->DataAddr() + kHeadSize;
+                    view.size = head->data_size;
+                    batch_.push_back(view);
+                    batch_heads_.push_back(*head);
+                    buf->Dig(total_size);
+                    continue;
+                }
+
+                if (head->method < kMaxMethods && methods_[head->method].stream && !(head->flags & kFlagOneWay))
+                {
+                    PERF_PHASE(kPhaseHandler);
+                    DispatchStream(buf, head);
+                    PERF_PHASE(kPhaseParse);
+                    buf->Dig(total_size);
+                    continue;
+                }
+
+                if (head->flags & kFlagOneWay)
+                {
+                    if (seq_check_)
+                    {
+                        CheckSeq(buf, head->id);
+                    }
+                    PERF_PHASE(kPhaseHandler);
+                    Dispatch(head->method, buf->DataAddr() + kHeadSize, head->data_size);
+                    PERF_PHASE(kPhaseParse);
+                    buf->Dig(total_size);
+                    continue;
+                }
+
+                char* req = buf->DataAddr() + kHeadSize;
+                uint32_t req_size = head->data_size;
+                bool cacheable = cache_ && head->method < kMaxMethods && methods_[head->method].cacheable;
+                uint64_t hash = 0;
+                uint64_t gen = 0;
+                CachedBody body;
+                if (cacheable)
+                {
+                    hash = ResponseCache::Hash(head->method, req, req_size);
+                    // before the handler, an invalidation while it runs keeps its result out
+                    gen = cache_->Generation(hash);
+                    body = cache_->Lookup(hash, head->method, req, req_size);
+                }
+
+                std::string data;
+                if (!body)
+                {
+                    PERF_PHASE(kPhaseHandler);
+                    data = Dispatch(head->method, req, req_size);
+                }
+                const std::string& resp = body ? *body : data;
+                head->data_size = resp.size();
+                // the response keeps the request's flags, a sealed request gets a sealed answer
+                bool sealed = head->flags & kFlagCrc;
+                uint32_t crc = 0;
+                if (sealed)
+                {
+                    crc = SealFrame(head, resp.c_str(), resp.size());
+                }
+                PERF_PHASE(kPhaseWrite);
+                struct iovec iov[3];
+                iov[0].iov_base = head;
+                iov[0].iov_len = kHeadSize;
+                iov[1].iov_base = (void*)resp.c_str();
+                iov[1].iov_len = resp.size();
+                iov[2].iov_base = &crc;
+                iov[2].iov_len = kCrcSize;
+                if (WriteFrames(buf, iov, sealed ? 3 : 2) == -1)
+                {
+                    PERF_PHASE(kPhaseParse);
+                    buf->ResetPos();
+                    break;
+                }
+                PERF_PHASE(kPhaseParse);
+
+                if (cacheable && !body)
+                {
+                    cache_->Insert(hash, head->method, req, req_size, std::make_shared<const std::string>(std::move(data)), 
+                        methods_[head->method].cache_ttl_ms, gen);
+                }
+        
+                buf->Dig(total_size);
+                // std::cout << "4 fd: " << buf->Fd() << " total_size: " << total_size << " pid_size: " << buf->PitSize() << " data_size: " << buf->DataSize() << " bytes: " << bytes  << std::endl;
+            }
+            else
+            {
+                break;
+            }
+        }
+        PERF_PHASE(kPhaseHandler);
+        FlushBatch(buf);
+        PERF_PHASE(kPhaseParse);
+        FlightRecorder::Record(kFlightFrames, buf->Fd(), frames);
+        buf->Move();
+        // std::cout << "5 fd: " << buf->Fd() << " pid_size: " << buf->PitSize() << " data_size: " << buf->DataSize() << " bytes: " << bytes  << std::endl;
+    }
+    else
     {
-        LOG_OUT("bind failed" , strerror(errno));
-        CLOSE_FD(lis_sock_);
-        unlink(address_.c_str());
         return false;
     }
+    return true;
+}
+
+void UDSockServer::DropBadFrame(Connection* buf, RpcRequestHdr* head, bool crc)
+{
+    FlightRecorder::Record(kFlightBadFrame, buf->Fd(), head->data_size, crc);
+    shutdown(buf->Fd(), SHUT_RDWR);
+    buf->ResetPos();
+}
+
+template <typename Backend>
+bool UDSockServer::Accept(Backend& backend, std::unordered_map<int, Connection*>& conn)
+{
+    // drain the backlog, a reconnect storm is then taken in a few wakeups instead of one
+    // per client, the cap keeps established connections served in between
+    int accepted = 0;
+    while (accepted < kAcceptBatch && backend.Accepting())
+    {
+        int cfd = accept4(lis_sock_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            break;
+        }
+
+        pid_t pid = -1;
+        if (seq_check_ || route_)
+        {
+            struct ucred cred;
+            socklen_t len = sizeof(cred);
+            if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+            {
+                pid = cred.pid;
+            }
+        }
+        UDSockServer* target = route_ ? route_(pid) : nullptr;
+        if (target && target != this)
+        {
+            target->Adopt(cfd, pid);
+            accepted++;
+            continue;
+        }
+        if (Attach(backend, conn, cfd, pid))
+        {
+            accepted++;
+        }
+    }
+    return accepted > 0;
+}
 
-    if (-1 == listen(lis_sock_, 5))
+template <typename Backend>
+bool UDSockServer::Attach(Backend& backend, std::unordered_map<int, Connection*>& conn, int cfd, pid_t pid)
+{
+    // allocated on the loop thread, a loop bound to a node first-touches it there
+    Connection* buf = new Connection(buffer_size_, cfd, arena_.get());
+    buf->chan = PushHandle(new PushChannel(this, cfd));
+    buf->pid = pid;
+    if (!backend.Add(cfd, buf, kWatchConn))
     {
-        LOG_OUT("listen failed" , strerror(errno));
-        CLOSE_FD(lis_sock_);
-        unlink(address_.c_str());
+        perror("watch new conn");
+        delete buf;
         return false;
     }
+    conn[cfd] = buf;
 
-    // thread_ = std::thread(&UDSockServer::Run, this);
+    if (credits_)
+    {
+        RpcRequestHdr head;
+        head.id = credits_;
+        head.data_size = 0;
+        head.method = 0;
+        head.flags = kFlagCredit;
+        SendBytes(cfd, (const char*)&head, kHeadSize);
+    }
 
+    FlightRecorder::Record(kFlightAccept, cfd, buf->pid);
     return true;
 }
 
-bool UDSockServer::Accept(int efd, int fd, std::unordered_map<int, Buffer*>& conn)
+template <typename Backend>
+void UDSockServer::AttachAdopted(Backend& backend, std::unordered_map<int, Connection*>& conn)
 {
-    struct epoll_event tep;
-    int res = 0;
-    int cfd = accept(fd, NULL, NULL);
-    if (cfd == -1) 
+    std::vector<std::pair<int, pid_t>> adopted;
     {
-        perror("accept");
-        return false;
+        std::lock_guard<std::mutex> _(lock_push_);
+        adopted.swap(adopted_);
+    }
+    for (auto& it : adopted)
+    {
+        Attach(backend, conn, it.first, it.second);
     }
+}
 
-    Buffer* buf = new Buffer(buffer_size_, cfd);
-    tep.events = EPOLLIN; 
-    tep.data.ptr = (void*)buf;
-    res = epoll_ctl(efd, EPOLL_CTL_ADD, cfd, &tep);
-    if (res == -1)
+void UDSockServer::Adopt(int fd, pid_t pid)
+{
     {
-        perror("EPOLL_CTL_ADD new conn");
-        delete buf;
-        return false;
+        std::lock_guard<std::mutex> _(lock_push_);
+        adopted_.push_back(std::make_pair(fd, pid));
     }
-    conn[cfd] = buf;
+    uint64_t one = 1;
+    if (notify_fd_ != -1 && write(notify_fd_, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    {
+        perror("notify adopt");
+    }
+}
 
-    std::cout << "new client connected" << std::endl;
-    return true;
+void UDSockServer::SetNumaNode(int node)
+{
+    numa_node_ = node;
 }
 
+void UDSockServer::SetRouter(const RouteCbk& route)
+{
+    route_ = route;
+}
 
 int UDSockServer::Run()
 {
-    struct epoll_event tep, events[kMaxFiles];
-    std::unordered_map<int, Buffer*> conn;
-    int res = 0, event_cnt = 0;
-    int efd = epoll_create(kMaxFiles);
-    if (efd == -1)
+    return Serve<EpollBackend>();
+}
+
+template <typename Backend>
+int UDSockServer::Serve()
+{
+    if (numa_node_ >= 0 && !NumaTopology::Get().BindThread(numa_node_))
+    {
+        LOG_OUT("bind to numa node failed", std::to_string(numa_node_));
+    }
+    // after binding, so the pages are faulted on this loop's node
+    OpenArena();
+
+    Backend backend;
+    BackendEvent events[kMaxFiles];
+    std::unordered_map<int, Connection*> conn;
+    int event_cnt = 0;
+    if (!backend.Open())
     {
-        perror("epoll_create");
+        perror(Backend::Name());
         return -1;
     }
     
-    Buffer* tbuf = new Buffer(buffer_size_, lis_sock_);
-    tep.events = EPOLLIN;
-    tep.data.ptr = tbuf;
-	res = epoll_ctl(efd, EPOLL_CTL_ADD, lis_sock_, &tep);
-    if (res == -1)
-    {
-        perror("epoll_ctl");
-        delete tbuf;
+    // a loop serving only adopted connections has no listener
+    if (lis_sock_ != -1)
+    {
+        Connection* tbuf = new Connection(buffer_size_, lis_sock_);
+        if (!backend.Add(lis_sock_, tbuf, kWatchListen))
+        {
+            perror("watch listener");
+            delete tbuf;
+            return -1;
+        }
+        conn[lis_sock_] = tbuf;
+    }
+
+    notify_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notify_fd_ == -1)
+    {
+        perror("eventfd");
         return -1;
     }
-    conn[lis_sock_] = tbuf;
+    Connection* nbuf = new Connection(0, notify_fd_);
+    if (!backend.Add(notify_fd_, nbuf, kWatchNotify))
+    {
+        perror("watch notify");
+        delete nbuf;
+        return -1;
+    }
+    conn[notify_fd_] = nbuf;
+    // adopted before the eventfd existed
+    AttachAdopted(backend, conn);
+
+    for (Connection* buf : inherited_)
+    {
+        if (!backend.Add(buf->Fd(), buf, kWatchConn))
+        {
+            perror("watch inherited conn");
+            buf->chan->Close();
+            delete buf;
+            continue;
+        }
+        conn[buf->Fd()] = buf;
+        if (on_subscribe_)
+        {
+            for (uint16_t topic : buf->topics)
+            {
+                on_subscribe_(topic, buf->chan, true);
+            }
+        }
+        FlightRecorder::Record(kFlightAccept, buf->Fd(), buf->pid);
+    }
+    inherited_.clear();
+
+    int ctrl_lis = -1;
+    int ctrl = -1;
+    struct timespec drain_begin;
+    if (!ctrl_address_.empty())
+    {
+        ctrl_lis = OpenCtrl();
+        Connection* cbuf = ctrl_lis == -1 ? nullptr : new Connection(0, ctrl_lis);
+        if (!cbuf || !backend.Add(ctrl_lis, cbuf, kWatchNotify))
+        {
+            perror("hot restart control");
+            delete cbuf;
+            return -1;
+        }
+        conn[ctrl_lis] = cbuf;
+    }
+
+    for (int i = 0; i < kMaxMethods && stream_threads_.empty(); i++)
+    {
+        if (methods_[i].stream)
+        {
+            stream_stop_ = false;
+            for (int w = 0; w < stream_workers_; w++)
+            {
+                stream_threads_.push_back(std::thread(&UDSockServer::StreamWorker, this));
+            }
+        }
+    }
 
     running_ = true;
 
     while(running_)
     {
-        event_cnt = epoll_wait(efd, events, kMaxFiles, 10);
-        // std::cout << "event_cnt = " << event_cnt << std::endl;
+        PERF_PHASE(kPhaseEpoll);
+        event_cnt = backend.Wait(events, kMaxFiles, 10);
+        PERF_PHASE(kPhaseParse);
         for (int i = 0; i < event_cnt; i++)
         {
-            Buffer* buf = reinterpret_cast<Buffer*>(events[i].data.ptr);
+            Connection* buf = reinterpret_cast<Connection*>(events[i].ptr);
 
-            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            if (events[i].events & kEventErr)
             {
-                if (events[i].events & EPOLLERR)
-                    LOG_OUT("EPOLLERR event", strerror(errno));
-                else
-                    LOG_OUT("EPOLLHUP event", strerror(errno));
+                FlightRecorder::Record(kFlightClose, buf->Fd(), events[i].events);
 
-                res = epoll_ctl(efd, EPOLL_CTL_DEL, buf->Fd(), NULL);
-                if (res == -1)
+                // the peer may have written frames right before closing, serve them first
+                if ((events[i].events & kEventIn) && buf->Fd() != lis_sock_)
                 {
-                    perror("EPOLL_CTL_DEL");
+                    while (HandleRead(buf));
                 }
 
+                backend.Remove(buf->Fd());
+                if (buf->chan)
+                {
+                    buf->chan->Close();
+                }
+                ReleaseStream(buf);
+                conn.erase(buf->Fd());
                 delete buf;
                 continue;
             }
 
-            if ((buf->Fd() == lis_sock_) && (events[i].events & EPOLLIN))
+            if ((buf->Fd() == lis_sock_) && (events[i].events & kEventIn))
             {
-                Accept(efd, buf->Fd(), conn);
+                Accept(backend, conn);
                 continue;
             }
 
-            if (events[i].events & EPOLLIN)
+            if (buf->Fd() == notify_fd_)
             {
-                int bytes = RecvData(buf->Fd(), buf->PitAddr(), buf->PitSize());
-                // std::cout << "1 fd: " << buf->Fd() << " pid_size: " << buf->PitSize() << " data_size: " << buf->DataSize() << " bytes: " << bytes  << std::endl;
-                if (bytes > 0)
+                uint64_t cnt;
+                if (read(notify_fd_, &cnt, sizeof(cnt)) > 0)
                 {
-                    buf->Fill(bytes);
-                    // std::cout << "2 fd: " << buf->Fd() << " pid_size: " << buf->PitSize() << " data_size: " << buf->DataSize() << " bytes: " << bytes  << std::endl;
-                    while(buf->DataSize() > kHeadSize)
-                    {
-                        RpcRequestHdr* head = reinterpret_cast<RpcRequestHdr*>(buf->DataAddr());
-                        int32_t total_size = head->data_size + kHeadSize;
-                        if (total_size > buf->Size())
-                        {
-                            buf->Expand(total_size + 2 * kHeadSize);
-                        }
-                        if (total_size <= buf->DataSize())
-                        {
+                    FlushPush(backend, conn);
+                    AttachAdopted(backend, conn);
+                }
+                continue;
+            }
 
-                            // std::cout << "3 fd: " << buf->Fd() << " total_size: " << total_size << " pid_size: " << buf->PitSize() << " data_size: " << buf->DataSize() << " bytes: " << bytes  << std::endl;
-                            std::string data = on_request_(buf->DataAddr() + kHeadSize, head->data_size);
-                            head->data_size = data.size();
-                            if (WriteVec(buf->Fd(), (void*)head, kHeadSize, (void*)data.c_str(), data.size()) == -1)
-                            {
-                                std::cout << "send data failed: " << strerror(errno) << std::endl;
-                                buf->ResetPos();
-                                break;
-                            }
-                    
-                            buf->Dig(total_size);
-                            // std::cout << "4 fd: " << buf->Fd() << " total_size: " << total_size << " pid_size: " << buf->PitSize() << " data_size: " << buf->DataSize() << " bytes: " << bytes  << std::endl;
-                        }
-                        else
-                        {
-                            break;
-                        }
+            if (buf->Fd() == ctrl_lis)
+            {
+                int fd = accept4(ctrl_lis, NULL, NULL, SOCK_CLOEXEC);
+                if (fd == -1 || ctrl != -1)
+                {
+                    CLOSE_FD(fd);
+                    continue;
+                }
+                // stop reading, frames arriving from now on are left for the new process
+                ctrl = fd;
+                clock_gettime(CLOCK_MONOTONIC, &drain_begin);
+                for (auto it = conn.begin(); it != conn.end(); it++)
+                {
+                    if (it->first != notify_fd_ && it->first != ctrl_lis)
+                    {
+                        backend.Remove(it->first);
+                    }
+                    if (it->second->chan)
+                    {
+                        std::lock_guard<std::mutex> _(it->second->chan->lock_);
+                        it->second->chan->blocked_ = false;
                     }
-                    buf->Move();
-                    // std::cout << "5 fd: " << buf->Fd() << " pid_size: " << buf->PitSize() << " data_size: " << buf->DataSize() << " bytes: " << bytes  << std::endl;
                 }
-                else
+                continue;
+            }
+
+            if ((events[i].events & kEventOut) && buf->chan)
+            {
+                FlushOut(backend, buf);
+            }
+
+            if (events[i].events & kEventIn)
+            {
+                if (!HandleRead(buf))
+                {
+                    FlightRecorder::Record(kFlightRecvError, buf->Fd(), errno);
+                }
+            }
+        }
+
+        if (ctrl != -1)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            uint64_t drain_us = (now.tv_sec - drain_begin.tv_sec) * 1000000ULL + (now.tv_nsec - drain_begin.tv_nsec) / 1000;
+            if (!Drain(conn) && drain_us < kHandOverDrainMs * 1000ULL)
+            {
+                continue;
+            }
+            if (HandOver(ctrl, conn, drain_us))
+            {
+                // the new process owns the socket paths now, cleanup below only closes our copies
+                handed_over_ = true;
+                running_ = false;
+            }
+            else
+            {
+                LOG_OUT("hot restart failed, serving on", strerror(errno));
+                for (auto it = conn.begin(); it != conn.end(); it++)
                 {
-                    std::cout << "recv failed: bytes = " << bytes  << " " << strerror(errno) << std::endl;
+                    if (it->first != notify_fd_ && it->first != ctrl_lis)
+                    {
+                        backend.Add(it->first, it->second, it->first == lis_sock_ ? kWatchListen : kWatchConn);
+                    }
+                    if (it->second->chan)
+                    {
+                        FlushOut(backend, it->second);
+                    }
                 }
             }
+            CLOSE_FD(ctrl);
         }
     }
-    close(efd);
+    backend.Close();
+    notify_fd_ = -1;
     for (auto it = conn.begin(); it != conn.end(); it++)
     {
         if (it->second)
         {
+            if (it->second->chan)
+            {
+                it->second->chan->Close();
+            }
             delete it->second;
         }
     }
+    // writers parked on a closed channel return at once
+    StopStreamWorkers();
     LOG_OUT("udsocket server thread exit", "");
     return 0;
 }
 
+template int UDSockServer::Serve<EpollBackend>();
+template int UDSockServer::Serve<PollBackend>();
+template int UDSockServer::Serve<BlockingBackend>();
+
 void UDSockServer::Stop()
 {
     running_ = false;
     CLOSE_FD(lis_sock_);
-    unlink(address_.c_str());
+    if (!handed_over_)
+    {
+        unlink(address_.c_str());
+        if (!ctrl_address_.empty())
+        {
+            unlink(ctrl_address_.c_str());
+        }
+    }
     if (thread_.joinable())
     {
         thread_.join();
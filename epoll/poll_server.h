@@ -1,33 +1,471 @@
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <vector>
 #include <functional>
 #include <unordered_map>
+#include <unordered_set>
 #include "poll_common.h"
+#include "response_cache.h"
+#include "event_backend.h"
 
 class UDSockServer : protected SockIO
 {
+    struct Connection;
+
+public:
+    // output side of a subscribed connection, Push() may be called from any thread. Frames
+    // are queued and the loop writes what the socket takes, a subscriber that stops reading
+    // holds up nobody else. One whose queue grows past SetMaxQueuedOutput() is disconnected
+    class PushChannel : public std::enable_shared_from_this<PushChannel>
+    {
+    public:
+        // -EPIPE once the connection is gone, -ENOBUFS when the subscriber fell too far behind
+        int Push(uint16_t topic, const std::string& data);
+
+        bool Alive();
+
+    private:
+        friend class UDSockServer;
+
+        PushChannel(UDSockServer* server, int fd) 
+            : server_(server), fd_(fd), closed_(false), armed_(false), crc_(false), overflow_(false), blocked_(false), out_pos_(0) {}
+
+        void Close();
+
+        // queue a frame for the loop to write, notify is set when the loop has to be woken.
+        // -ENOBUFS when the queue is full, the loop then drops the connection
+        int Append(RpcRequestHdr head, const char* data, uint64_t size, bool* notify);
+
+        int Queue(const struct iovec* iov, int cnt, bool* notify);
+
+        inline uint64_t Queued()
+        {
+            return out_.size() - out_pos_;
+        }
+
+        UDSockServer* server_;
+        int fd_;
+        bool closed_;
+        bool armed_;        // the loop is going to write out_, no need to wake it
+        bool crc_;          // the client seals its frames, seal pushes and async replies too
+        bool overflow_;     // out_ hit the limit, the loop shuts the connection down
+        bool blocked_;      // the socket is full, the loop waits for it to be writable
+        std::mutex lock_;
+        std::condition_variable writable_;  // the loop wrote some of out_ or the channel closed
+        std::string out_;
+        size_t out_pos_;    // bytes of out_ already written
+        std::unordered_map<uint64_t, bool> deferred_;   // async request id -> cancelled
+    };
+    using PushHandle = std::shared_ptr<PushChannel>;
+
+    // completes a request of a method registered with RegisterAsyncMethod. It may outlive
+    // the handler and be used from any thread, the response goes out through the loop.
+    // All replies must be done before the server is destroyed.
+    class Responder
+    {
+    public:
+        Responder() : id_(0), method_(0), oneway_(true) {}
+
+        // once per request, -ECANCELED when the client cancelled it, -EPIPE when the
+        // connection is gone and -EALREADY for a second reply
+        int Reply(const std::string& data);
+
+        // true once the client cancelled the request or disconnected, the handler may give up
+        bool Cancelled();
+
+    private:
+        friend class UDSockServer;
+
+        Responder(const PushHandle& chan, uint64_t id, uint16_t method, bool oneway)
+            : chan_(chan), id_(id), method_(method), oneway_(oneway)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &begin_);
+        }
+
+        PushHandle chan_;
+        uint64_t id_;
+        uint16_t method_;
+        bool oneway_;
+        struct timespec begin_;
+    };
+
+    // sends a response in pieces of at most kMaxChunkSize from a stream worker thread.
+    // Write() parks the worker while more than kStreamWindow bytes wait for the client, so
+    // neither side has to hold the whole message and the loop goes on serving the others
+    class ChunkWriter
+    {
+    public:
+        int Write(const char* data, uint64_t size);
+
+        int Write(const std::string& data)
+        {
+            return Write(data.c_str(), data.size());
+        }
+
+        uint64_t Sent()
+        {
+            return sent_;
+        }
+
+        // true once the client cancelled this request or disconnected, Write() then fails
+        bool Cancelled();
+
+    private:
+        friend class UDSockServer;
+
+        ChunkWriter(const PushHandle& chan, uint64_t id, uint16_t method)
+            : chan_(chan), id_(id), method_(method), sent_(0), failed_(false) {}
+
+        int SendFrame(const char* data, uint32_t size, uint16_t flags);
+
+        PushHandle chan_;
+        uint64_t id_;
+        uint16_t method_;
+        uint64_t sent_;
+        bool failed_;
+    };
+
+    // one request handed to a batch handler, data points into the receive buffer and
+    // is valid during the call only
+    struct RequestView
+    {
+        uint64_t id;
+        uint16_t method;
+        bool oneway;        // its response is dropped
+        const char* data;
+        uint64_t size;
+    };
+
+private:
 using RequestCbk = std::function<std::string(char* data, uint64_t size)>;
+using MethodInvoker = std::string (*)(void* ctx, char* data, uint64_t size);
+using SeqGapCbk = std::function<void(pid_t pid, uint64_t expect_seq, uint64_t recv_seq)>;
+using SubscribeCbk = std::function<void(uint16_t topic, const PushHandle& handle, bool subscribe)>;
+using StreamCbk = std::function<void(char* data, uint64_t size, ChunkWriter& writer)>;
+using AsyncCbk = std::function<void(char* data, uint64_t size, const Responder& responder)>;
+using RouteCbk = std::function<UDSockServer*(pid_t pid)>;
+using BatchCbk = std::function<void(const RequestView* reqs, size_t count, std::string* resps)>;
+
+    struct Connection : public Buffer
+    {
+        pid_t pid;
+        PushHandle chan;
+        std::unordered_set<uint64_t> cancelled;   // ids with a cancel frame already received
+        std::unordered_set<uint16_t> topics;      // subscribed, handed over on a hot restart
+        bool crc;                                 // a sealed frame arrived, seal what goes back
+        uint64_t stream;                          // one-way stream announced by the client, 0 before
+        uint64_t oneway_next;                     // next one-way sequence when no stream was announced
+
+        Connection(const int& size, const int& fd, BufferArena* arena = nullptr) 
+            : Buffer(size, fd, arena), pid(-1), crc(false), stream(0), oneway_next(0) {}
+    };
+
+    struct SeqStream
+    {
+        uint64_t next;      // sequence expected, 0 before the first frame
+        uint32_t conns;     // connections carrying it, idle streams are forgotten past kMaxSeqStreams
+    };
+
+    struct MethodEntry
+    {
+        MethodInvoker invoke = nullptr;
+        void* ctx = nullptr;
+        RequestCbk cbk;
+        StreamCbk stream;
+        AsyncCbk async;
+        BatchCbk batch;
+        bool cacheable = false;
+        uint32_t cache_ttl_ms = 0;
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::atomic<uint64_t> max_ns{0};
+    };
 
 public:
+    struct MethodStats
+    {
+        uint64_t calls;
+        uint64_t total_ns;
+        uint64_t max_ns;
+    };
+
     UDSockServer(const int& buffer_size = 5120);
 
     ~UDSockServer();
 
     bool Init(const std::string& server_addr, const RequestCbk& on_request);
 
+    // listen backlog, kListenBacklog unless set before Init(). Clients reconnecting all at
+    // once after a restart get EAGAIN from connect() when it overflows
+    void SetBacklog(int backlog);
+
+    // hot restart, call before Run(): the loop listens on ctrl_addr for a new process calling
+    // TakeOver(). It then stops reading, waits up to kHandOverDrainMs for async replies and
+    // pushes still queued, passes the listener and every connection over and Run() returns
+    // with HandedOver() true. Clients stay connected, requests sent meanwhile wait in the socket
+    void EnableHotRestart(const std::string& ctrl_addr);
+
+    // instead of Init() in the new process: take over the listener and connections of the
+    // server hot restarting on ctrl_addr. Register methods and the subscribe callback first
+    // and Run() right after, clients are not served in between. Checksums and one-way
+    // sequences carry over, call EnableSeqCheck() before this for the latter
+    bool TakeOver(const std::string& ctrl_addr, const std::string& server_addr, const RequestCbk& on_request);
+
+    // true once this server passed its connections to a new process
+    bool HandedOver();
+
+    // carve connection buffers, including the ones grown for large frames, out of a
+    // huge page arena of bytes (kArenaSize when 0) that Run() maps, pre-faults and with
+    // lock mlocks on the loop thread, after binding it to its NUMA node. Call before Run(),
+    // buffers that do not fit and connections inherited by TakeOver() come from the heap,
+    // as do responses and the output queued for slow readers
+    void EnableBufferArena(uint64_t bytes, bool lock);
+
+    // false without an arena, reserved stays 0 until Run() mapped it
+    bool GetArenaStats(BufferArena::Stats& stats);
+
+    // register a handler for RpcRequestHdr::method, must be called before Run(). Methods
+    // without one fall back to method 0, an empty response when it has none either
+    bool RegisterMethod(uint16_t method, const RequestCbk& on_request);
+
+    // typed adapters, dispatched through a plain function pointer instead of std::function
+    template <typename T, std::string (T::*Fn)(char*, uint64_t)>
+    bool RegisterMethod(uint16_t method, T* obj)
+    {
+        return SetMethod(method, &UDSockServer::InvokeMember<T, Fn>, obj);
+    }
+
+    template <std::string (*Fn)(char*, uint64_t)>
+    bool RegisterMethod(uint16_t method)
+    {
+        return SetMethod(method, &UDSockServer::InvokeFree<Fn>, nullptr);
+    }
+
+    // the handler writes its response through the ChunkWriter, the last frame is sent when it
+    // returns. It runs on a stream worker with a copy of the request, a slow reader parks
+    // the worker and not the loop
+    bool RegisterStreamMethod(uint16_t method, const StreamCbk& on_request);
+
+    // threads running stream handlers, kStreamWorkers unless set before Run(). Streams
+    // beyond them wait for a free worker
+    void SetStreamWorkers(int workers);
+
+    // the handler only starts the work and returns, the loop goes on serving other requests
+    // until responder.Reply() is called. data is valid during the call only, responses
+    // may complete out of order and are matched by request id. Not served from the cache,
+    // handler time is measured up to the reply. Replaces a RegisterMethod() handler of the
+    // same method, unknown methods falling back to an async method 0 get an empty response
+    bool RegisterAsyncMethod(uint16_t method, const AsyncCbk& on_request);
+
+    // the handler gets every complete frame of the method from one read, up to kMaxBatch,
+    // and fills resps[i] for reqs[i]. Responses go out in one gathered write. Frames are
+    // not held back waiting for more, a batch is what the client pipelined. Not served
+    // from the cache, calls counts requests and handler time is per batch
+    bool RegisterBatchMethod(uint16_t method, const BatchCbk& on_batch);
+
+    bool GetMethodStats(uint16_t method, MethodStats& stats);
+
+    // responses of a method that depends only on its request bytes are served from the
+    // cache, ttl_ms 0 keeps them until evicted or invalidated, call before Run()
+    bool SetCacheable(uint16_t method, uint32_t ttl_ms);
+
+    // memory for cached responses, kCacheBudget unless set before SetCacheable()
+    void SetCacheBudget(uint64_t bytes);
+
+    // may be called from any thread once the data behind a method changed, a response a
+    // handler is computing meanwhile is sent but not cached
+    void InvalidateCache(uint16_t method);
+
+    void InvalidateCache(uint16_t method, const std::string& request);
+
+    bool GetCacheStats(ResponseCache::Stats& stats);
+
+    // frames announcing a larger data_size drop the connection, kMaxFrameSize by default.
+    // Frames with kFlagCrc are checked whatever is set here and answered sealed
+    void SetMaxFrameSize(uint32_t max_bytes);
+
+    // output one connection may have queued, pushes, async replies and the responses waiting
+    // behind them, kMaxQueuedOutput unless set before Run(). A connection reaching it is dropped
+    void SetMaxQueuedOutput(uint64_t bytes);
+
+    // advertised to every new connection as the number of requests it may keep in flight
+    void SetCredits(uint32_t credits);
+
+    // track one-way sequence numbers per client stream, on_gap is called when frames went missing.
+    // A stream outlives its connection, so frames lost across a reconnect are noticed too.
+    // Call before Run()
+    void EnableSeqCheck(const SeqGapCbk& on_gap);
+
+    uint64_t OneWayLost();
+
+    // requests dropped because the client cancelled them before they ran
+    uint64_t CancelledRequests();
+
+    // called on the loop thread when a client (un)subscribes a topic, keep the handle to push later
+    void SetSubscribeCbk(const SubscribeCbk& on_subscribe);
+
+    // Run() binds its thread to the CPUs of node first, so the connections, buffers and cache
+    // it allocates come from that node's memory. Call before Run()
+    void SetNumaNode(int node);
+
+    // called on the loop thread for every accepted connection with the peer pid, a server
+    // other than this one gets the connection through Adopt(). Call before Run()
+    void SetRouter(const RouteCbk& route);
+
+    // serve a connection accepted elsewhere, may be called from any thread. A server
+    // that only serves adopted connections needs no Init(), just Run()
+    void Adopt(int fd, pid_t pid);
+
+    // serves on epoll, same as Serve<EpollBackend>()
     int Run();
 
+    // the loop over any backend from event_backend.h, EpollBackend, PollBackend and
+    // BlockingBackend are instantiated in poll_server.cpp, add a line there for a new one
+    template <typename Backend>
+    int Serve();
+
     void Stop();
 
 protected:
 
-    bool Accept(int efd, int fd, std::unordered_map<int, Buffer*>& conn);
+    template <typename Backend>
+    bool Accept(Backend& backend, std::unordered_map<int, Connection*>& conn);
+
+    template <typename Backend>
+    bool Attach(Backend& backend, std::unordered_map<int, Connection*>& conn, int cfd, pid_t pid);
+
+    // connections queued by Adopt()
+    template <typename Backend>
+    void AttachAdopted(Backend& backend, std::unordered_map<int, Connection*>& conn);
+
+    inline void CheckSeq(Connection* conn, uint64_t seq);
+
+    void BindStream(Connection* conn, uint64_t stream);
+
+    void ReleaseStream(Connection* conn);
+
+    bool HandleRead(Connection* buf);
+
+    // the stream cannot be parsed any further, the hang-up that follows closes the connection
+    void DropBadFrame(Connection* buf, RpcRequestHdr* head, bool crc);
+
+    int OpenCtrl();
+
+    void OpenArena();
+
+    // write queued output without blocking, true once no async reply or push is left on any connection
+    bool Drain(std::unordered_map<int, Connection*>& conn);
+
+    bool HandOver(int ctrl, std::unordered_map<int, Connection*>& conn, uint64_t drain_us);
+
+    void HandleControl(Connection* buf, RpcRequestHdr* head);
+
+    void ScanCancel(Connection* buf);
+
+    void NotifyPush(const PushHandle& chan);
+
+    template <typename Backend>
+    void FlushPush(Backend& backend, std::unordered_map<int, Connection*>& conn);
+
+    // write queued output without blocking, the socket is watched while some is left
+    template <typename Backend>
+    void FlushOut(Backend& backend, Connection* buf);
+
+    // write as much of out_ as the socket takes, chan->lock_ held, true once all went out
+    bool WriteOut(PushChannel* chan);
+
+    // a response from the loop, written without waiting. What the socket does not take is
+    // queued on the channel, as is everything behind output still waiting
+    int64_t WriteFrames(Connection* buf, struct iovec* iov, int cnt);
+
+    bool SetMethod(uint16_t method, MethodInvoker invoke, void* ctx);
+
+    inline std::string Dispatch(uint16_t method, char* data, uint64_t size);
+
+    void DispatchStream(Connection* buf, RpcRequestHdr* head);
+
+    void StreamWorker();
+
+    void StopStreamWorkers();
+
+    void DispatchAsync(Connection* buf, RpcRequestHdr* head);
+
+    // run the batch collected from buf and write its responses, false when the write failed
+    bool FlushBatch(Connection* buf);
+
+    void RecordReply(uint16_t method, const struct timespec& begin);
+
+    inline uint64_t RecordCost(MethodEntry& entry, const struct timespec& begin);
+
+    static std::string InvokeCbk(void* ctx, char* data, uint64_t size)
+    {
+        return (*reinterpret_cast<RequestCbk*>(ctx))(data, size);
+    }
+
+    template <typename T, std::string (T::*Fn)(char*, uint64_t)>
+    static std::string InvokeMember(void* ctx, char* data, uint64_t size)
+    {
+        return (reinterpret_cast<T*>(ctx)->*Fn)(data, size);
+    }
+
+    template <std::string (*Fn)(char*, uint64_t)>
+    static std::string InvokeFree(void*, char* data, uint64_t size)
+    {
+        return Fn(data, size);
+    }
 
 private:
 
     int lis_sock_;
+    int backlog_;
     uint32_t buffer_size_;
     std::thread thread_;
     std::string address_;
-    RequestCbk on_request_;
+    std::vector<MethodEntry> methods_;
+    bool seq_check_;
+    SeqGapCbk on_seq_gap_;
+    std::unordered_map<uint64_t, SeqStream> oneway_seq_;    // by stream id, loop thread only
+    std::atomic<uint64_t> oneway_lost_;
+    std::atomic<uint64_t> cancelled_;
+    SubscribeCbk on_subscribe_;
+    uint32_t credits_;
+    uint32_t max_frame_size_;
+    uint64_t max_queued_;
+    std::unique_ptr<ResponseCache> cache_;
+    std::unique_ptr<BufferArena> arena_;
+    uint64_t arena_bytes_;      // 0 when no arena is wanted
+    bool arena_lock_;
+    int notify_fd_;
+    std::mutex lock_push_;
+    std::vector<PushHandle> push_ready_;
+    std::vector<std::pair<int, pid_t>> adopted_;    // guarded by lock_push_
+    struct StreamJob
+    {
+        PushHandle chan;
+        uint64_t id;
+        uint16_t method;
+        std::string request;
+    };
+    int stream_workers_;
+    std::vector<std::thread> stream_threads_;
+    std::mutex lock_stream_;
+    std::condition_variable stream_cv_;
+    std::deque<StreamJob> stream_jobs_;     // guarded by lock_stream_
+    bool stream_stop_;
+    // batch under construction, loop thread only, kept to reuse their memory
+    std::vector<RequestView> batch_;
+    std::vector<RpcRequestHdr> batch_heads_;
+    std::vector<std::string> batch_resps_;
+    std::vector<uint32_t> batch_crcs_;
+    std::vector<struct iovec> batch_iov_;
+    int numa_node_;
+    RouteCbk route_;
+    std::string ctrl_address_;
+    std::vector<Connection*> inherited_;    // from TakeOver(), watched once Run() starts
+    volatile bool handed_over_;
     volatile bool running_;
 };
@@ -0,0 +1,91 @@
+#ifndef _POLL_SERVER_CORO_
+#define _POLL_SERVER_CORO_
+#if __cplusplus < 202002L
+#error "poll_server_coro.h needs C++20 coroutines, build with -std=c++20"
+#endif
+#include <coroutine>
+#include <exception>
+#include "poll_server.h"
+
+// a request handler written as a coroutine, co_return the response body. It runs on the
+// loop thread until its first suspension, whatever resumes it later (a CoroClient call,
+// a timer, a disk thread) also sends the reply. The frame frees itself when it returns.
+class ServerTask
+{
+public:
+    struct promise_type
+    {
+        UDSockServer::Responder responder;
+
+        ServerTask get_return_object()
+        {
+            return ServerTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_value(const std::string& resp) { responder.Reply(resp); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    ServerTask(ServerTask&& other) : handle_(other.handle_)
+    {
+        other.handle_ = nullptr;
+    }
+
+    ~ServerTask()
+    {
+        // only a task that was never started still owns its frame
+        if (handle_)
+            handle_.destroy();
+    }
+
+    void Start(const UDSockServer::Responder& responder)
+    {
+        std::coroutine_handle<promise_type> handle = handle_;
+        handle_ = nullptr;
+        handle.promise().responder = responder;
+        handle.resume();
+    }
+
+private:
+    explicit ServerTask(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// co_await ThisRequest() inside a ServerTask gives its Responder, e.g. to poll Cancelled()
+// between steps, it never suspends
+struct ThisRequest
+{
+    UDSockServer::Responder responder;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<ServerTask::promise_type> handle) noexcept
+    {
+        responder = handle.promise().responder;
+        return false;
+    }
+
+    UDSockServer::Responder await_resume()
+    {
+        return responder;
+    }
+};
+
+// fn(std::string request) returns a ServerTask, the request bytes are copied into the
+// coroutine frame because the receive buffer is reused once the handler suspends. Like
+// RegisterAsyncMethod() it replaces a synchronous handler of the same method
+template <typename F>
+bool RegisterCoroMethod(UDSockServer& server, uint16_t method, F fn)
+{
+    return server.RegisterAsyncMethod(method,
+        [fn](char* data, uint64_t size, const UDSockServer::Responder& responder) {
+            fn(std::string(data, size)).Start(responder);
+        });
+}
+
+#endif // _POLL_SERVER_CORO_
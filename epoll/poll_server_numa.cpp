@@ -0,0 +1,129 @@
+#include "poll_server_numa.h"
+#include "numa_topology.h"
+
+UDSockNumaServer::UDSockNumaServer(const int& buffer_size) : buffer_size_(buffer_size), arena_bytes_(0), arena_lock_(false)
+{
+
+}
+
+UDSockNumaServer::~UDSockNumaServer()
+{
+    Stop();
+}
+
+bool UDSockNumaServer::Init(const std::string& server_addr, const RequestCbk& on_request)
+{
+    nodes_ = NumaTopology::Get().Nodes();
+    for (size_t i = 0; i < nodes_.size(); i++)
+    {
+        std::unique_ptr<UDSockServer> loop(new UDSockServer(buffer_size_));
+        loop->SetNumaNode(nodes_[i]);
+        if (arena_bytes_)
+        {
+            loop->EnableBufferArena(arena_bytes_, arena_lock_);
+        }
+        if (i == 0)
+        {
+            if (!loop->Init(server_addr, on_request))
+            {
+                return false;
+            }
+            loop->SetRouter(std::bind(&UDSockNumaServer::Route, this, std::placeholders::_1));
+        }
+        else
+        {
+            loop->RegisterMethod(0, on_request);
+        }
+        loops_.push_back(std::move(loop));
+    }
+    return true;
+}
+
+bool UDSockNumaServer::RegisterMethod(uint16_t method, const RequestCbk& on_request)
+{
+    for (auto& loop : loops_)
+    {
+        if (!loop->RegisterMethod(method, on_request))
+        {
+            return false;
+        }
+    }
+    return !loops_.empty();
+}
+
+void UDSockNumaServer::EnableBufferArena(uint64_t bytes, bool lock)
+{
+    arena_bytes_ = bytes ? bytes : kArenaSize;
+    arena_lock_ = lock;
+    for (auto& loop : loops_)
+    {
+        loop->EnableBufferArena(arena_bytes_, arena_lock_);
+    }
+}
+
+void UDSockNumaServer::SetNodeHint(const NodeHintCbk& hint)
+{
+    hint_ = hint;
+}
+
+size_t UDSockNumaServer::Loops()
+{
+    return loops_.size();
+}
+
+UDSockServer& UDSockNumaServer::Loop(size_t index)
+{
+    return *loops_[index];
+}
+
+int UDSockNumaServer::Node(size_t index)
+{
+    return nodes_[index];
+}
+
+UDSockServer* UDSockNumaServer::Route(pid_t pid)
+{
+    int node = hint_ ? hint_(pid) : -1;
+    if (node < 0)
+    {
+        node = NumaTopology::Get().NodeOfPid(pid);
+    }
+    for (size_t i = 0; i < nodes_.size(); i++)
+    {
+        if (nodes_[i] == node)
+        {
+            return loops_[i].get();
+        }
+    }
+    // unknown node, stay on the listening loop
+    return nullptr;
+}
+
+int UDSockNumaServer::Run()
+{
+    if (loops_.empty())
+    {
+        return -1;
+    }
+    for (size_t i = 1; i < loops_.size(); i++)
+    {
+        threads_.push_back(std::thread(&UDSockServer::Run, loops_[i].get()));
+    }
+    return loops_[0]->Run();
+}
+
+void UDSockNumaServer::Stop()
+{
+    for (auto& loop : loops_)
+    {
+        loop->Stop();
+    }
+    for (auto& thread : threads_)
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+    threads_.clear();
+}
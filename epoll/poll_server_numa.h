@@ -0,0 +1,59 @@
+#ifndef _POLL_SERVER_NUMA_
+#define _POLL_SERVER_NUMA_
+#include <memory>
+#include <vector>
+#include "poll_server.h"
+
+// one loop per NUMA node, each bound to its node so the memory it allocates for
+// connections and responses stays local. The first loop listens and passes every
+// connection to the loop on its client's node
+class UDSockNumaServer
+{
+    using RequestCbk = std::function<std::string(char* data, uint64_t size)>;
+    using NodeHintCbk = std::function<int(pid_t pid)>;
+
+public:
+    UDSockNumaServer(const int& buffer_size = 5120);
+
+    ~UDSockNumaServer();
+
+    bool Init(const std::string& server_addr, const RequestCbk& on_request);
+
+    // on every loop, must be called before Run()
+    bool RegisterMethod(uint16_t method, const RequestCbk& on_request);
+
+    // an arena of bytes for each loop, mapped on its node, see UDSockServer::EnableBufferArena.
+    // Call before Run()
+    void EnableBufferArena(uint64_t bytes, bool lock);
+
+    // the node a client should be served on, -1 falls back to where its process runs
+    void SetNodeHint(const NodeHintCbk& hint);
+
+    size_t Loops();
+
+    // to register other kinds of handlers or read the stats of one loop
+    UDSockServer& Loop(size_t index);
+
+    int Node(size_t index);
+
+    // runs the first loop on the calling thread and the others on threads of their own
+    int Run();
+
+    void Stop();
+
+protected:
+
+    UDSockServer* Route(pid_t pid);
+
+private:
+
+    int buffer_size_;
+    uint64_t arena_bytes_;      // 0 when no arena is wanted
+    bool arena_lock_;
+    std::vector<int> nodes_;
+    std::vector<std::unique_ptr<UDSockServer>> loops_;
+    std::vector<std::thread> threads_;
+    NodeHintCbk hint_;
+};
+
+#endif // _POLL_SERVER_NUMA_
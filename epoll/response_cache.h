@@ -0,0 +1,247 @@
+#ifndef _RESPONSE_CACHE_
+#define _RESPONSE_CACHE_
+#include <stdint.h>
+#include <time.h>
+#include <cstring>
+#include <string>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+
+using CachedBody = std::shared_ptr<const std::string>;
+
+// responses of pure methods keyed by method and request bytes, split in shards with
+// their own lock and LRU list so invalidation from other threads rarely contends
+// with the loop. Bodies are shared, a hit is written out without copying. Every
+// invalidation bumps the generation of the shards it touches, a response computed
+// before it is not inserted after it.
+class ResponseCache
+{
+    static const int kShards = 16;
+    static const uint64_t kEntryOverhead = 96;   // list node, map node and Entry bookkeeping
+
+    struct Entry
+    {
+        uint64_t hash;
+        uint16_t method;
+        std::string key;
+        CachedBody body;
+        uint64_t expire_ms;     // 0 never expires
+    };
+
+    struct Shard
+    {
+        std::mutex lock;
+        std::list<Entry> lru;   // most recently used first
+        std::unordered_multimap<uint64_t, std::list<Entry>::iterator> index;
+        uint64_t bytes = 0;
+        std::atomic<uint64_t> gen{0};   // bumped under lock by every invalidation
+    };
+
+public:
+    struct Stats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t entries;
+        uint64_t bytes;
+        uint64_t budget;
+    };
+
+    ResponseCache(uint64_t budget) : budget_(budget), hits_(0), misses_(0), evictions_(0) {}
+
+    static uint64_t Hash(uint16_t method, const char* data, uint64_t size)
+    {
+        // 8 bytes per step multiply-xorshift, good enough to spread keys over shards and buckets
+        uint64_t h = 0x9E3779B97F4A7C15ULL ^ (size * 0xFF51AFD7ED558CCDULL) ^ method;
+        uint64_t v;
+        while (size >= 8)
+        {
+            memcpy(&v, data, 8);
+            h = (h ^ (v * 0xC4CEB9FE1A85EC53ULL)) * 0x9E3779B97F4A7C15ULL;
+            h ^= h >> 29;
+            data += 8;
+            size -= 8;
+        }
+        v = 0;
+        memcpy(&v, data, size);
+        h = (h ^ (v * 0xC4CEB9FE1A85EC53ULL)) * 0x9E3779B97F4A7C15ULL;
+        return h ^ (h >> 32);
+    }
+
+    CachedBody Lookup(uint64_t hash, uint16_t method, const char* data, uint64_t size)
+    {
+        Shard& shard = shards_[hash % kShards];
+        std::lock_guard<std::mutex> _(shard.lock);
+        auto range = shard.index.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            Entry& entry = *it->second;
+            if (entry.method != method || entry.key.size() != size || memcmp(entry.key.data(), data, size) != 0)
+            {
+                continue;
+            }
+            if (entry.expire_ms && entry.expire_ms <= NowMs())
+            {
+                Erase(shard, it);
+                break;
+            }
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return entry.body;
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return CachedBody();
+    }
+
+    // read before computing the response that is passed to Insert()
+    uint64_t Generation(uint64_t hash)
+    {
+        return shards_[hash % kShards].gen.load(std::memory_order_acquire);
+    }
+
+    // dropped when the shard was invalidated since gen was read
+    void Insert(uint64_t hash, uint16_t method, const char* data, uint64_t size, const CachedBody& body, uint32_t ttl_ms,
+        uint64_t gen)
+    {
+        uint64_t cost = size + body->size() + kEntryOverhead;
+        uint64_t limit = budget_ / kShards;
+        if (cost > limit)
+        {
+            return;
+        }
+
+        Shard& shard = shards_[hash % kShards];
+        std::lock_guard<std::mutex> _(shard.lock);
+        if (shard.gen.load(std::memory_order_relaxed) != gen)
+        {
+            return;
+        }
+        auto range = shard.index.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            Entry& entry = *it->second;
+            if (entry.method == method && entry.key.size() == size && memcmp(entry.key.data(), data, size) == 0)
+            {
+                Erase(shard, it);
+                break;
+            }
+        }
+
+        while (shard.bytes + cost > limit && !shard.lru.empty())
+        {
+            Entry& victim = shard.lru.back();
+            auto vrange = shard.index.equal_range(victim.hash);
+            for (auto it = vrange.first; it != vrange.second; ++it)
+            {
+                if (&*it->second == &victim)
+                {
+                    Erase(shard, it);
+                    break;
+                }
+            }
+            evictions_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        shard.lru.push_front(Entry());
+        Entry& entry = shard.lru.front();
+        entry.hash = hash;
+        entry.method = method;
+        entry.key.assign(data, size);
+        entry.body = body;
+        entry.expire_ms = ttl_ms ? NowMs() + ttl_ms : 0;
+        shard.index.insert(std::make_pair(hash, shard.lru.begin()));
+        shard.bytes += cost;
+    }
+
+    // drop one request's response
+    void Invalidate(uint16_t method, const char* data, uint64_t size)
+    {
+        uint64_t hash = Hash(method, data, size);
+        Shard& shard = shards_[hash % kShards];
+        std::lock_guard<std::mutex> _(shard.lock);
+        shard.gen.fetch_add(1, std::memory_order_release);
+        auto range = shard.index.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            Entry& entry = *it->second;
+            if (entry.method == method && entry.key.size() == size && memcmp(entry.key.data(), data, size) == 0)
+            {
+                Erase(shard, it);
+                return;
+            }
+        }
+    }
+
+    // drop every response of a method
+    void Invalidate(uint16_t method)
+    {
+        for (auto& shard : shards_)
+        {
+            std::lock_guard<std::mutex> _(shard.lock);
+            shard.gen.fetch_add(1, std::memory_order_release);
+            for (auto it = shard.index.begin(); it != shard.index.end();)
+            {
+                if (it->second->method == method)
+                    it = Erase(shard, it);
+                else
+                    ++it;
+            }
+        }
+    }
+
+    void Clear()
+    {
+        for (auto& shard : shards_)
+        {
+            std::lock_guard<std::mutex> _(shard.lock);
+            shard.gen.fetch_add(1, std::memory_order_release);
+            shard.index.clear();
+            shard.lru.clear();
+            shard.bytes = 0;
+        }
+    }
+
+    void GetStats(Stats& stats)
+    {
+        stats.hits = hits_.load(std::memory_order_relaxed);
+        stats.misses = misses_.load(std::memory_order_relaxed);
+        stats.evictions = evictions_.load(std::memory_order_relaxed);
+        stats.entries = stats.bytes = 0;
+        stats.budget = budget_;
+        for (auto& shard : shards_)
+        {
+            std::lock_guard<std::mutex> _(shard.lock);
+            stats.entries += shard.lru.size();
+            stats.bytes += shard.bytes;
+        }
+    }
+
+private:
+    using IndexIter = std::unordered_multimap<uint64_t, std::list<Entry>::iterator>::iterator;
+
+    IndexIter Erase(Shard& shard, IndexIter it)
+    {
+        shard.bytes -= it->second->key.size() + it->second->body->size() + kEntryOverhead;
+        shard.lru.erase(it->second);
+        return shard.index.erase(it);
+    }
+
+    static uint64_t NowMs()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+    }
+
+    uint64_t budget_;
+    Shard shards_[kShards];
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    std::atomic<uint64_t> evictions_;
+};
+
+#endif // _RESPONSE_CACHE_
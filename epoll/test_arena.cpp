@@ -0,0 +1,127 @@
+#include "poll_server.h"
+#include "poll_client.h"
+#include <unistd.h>
+#include <atomic>
+#include <algorithm>
+
+std::string do_sponse(char* data, uint64_t size)
+{
+    return std::string(data, 16 < size ? 16 : size);
+}
+
+int64_t diff_us(struct timespec& start, struct timespec& end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000000 + ((end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+// buffers grown and dropped at random sizes up to max_size, as connections do, must all
+// be served by an arena of four times their largest size: every size class holds at most
+// one block per buffer and one being grown into, and the classes up to max_size add up
+// to twice its power of two
+int churn(int buffers, int max_size, int rounds)
+{
+    BufferArena arena;
+    if (!arena.Open((uint64_t)(buffers + 1) * max_size * 4, false))
+    {
+        perror("arena");
+        return 1;
+    }
+    std::vector<std::unique_ptr<SockIO::Buffer>> bufs(buffers);
+    srand(1);
+    for (int i = 0; i < rounds; i++)
+    {
+        auto& buf = bufs[rand() % buffers];
+        int size = 1024 + rand() % (max_size - 1024 + 1);
+        if (!buf || rand() % 8 == 0)
+        {
+            buf.reset(new SockIO::Buffer(5120, -1, &arena));
+        }
+        else
+        {
+            buf->Expand(size);
+        }
+    }
+    BufferArena::Stats stats;
+    arena.GetStats(stats);
+    std::cout << "--churn buffers " << buffers << " max size " << max_size << " rounds " << rounds << " reserved " << stats.reserved
+        << " in use " << stats.in_use << " allocs " << stats.allocs << " fallbacks " << stats.fallbacks << std::endl;
+    return stats.fallbacks == 0 ? 0 : 1;
+}
+
+// usage: test_arena [--arena|--arena-lock] [clients] [size], a fresh server gets one request
+// of size bytes from every client, so each connection buffer grows once in the request
+// path. Run it once per mode, a process that already faulted its heap hides the difference.
+// test_arena --churn [buffers] [size] [rounds] fails when a churned arena falls back to the heap
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    std::string mode = argc > 1 ? argv[1] : "--heap";
+    if (mode == "--churn")
+    {
+        return churn(argc > 2 ? atoi(argv[2]) : 64, argc > 3 ? atoi(argv[3]) : 256 * 1024, argc > 4 ? atoi(argv[4]) : 200000);
+    }
+    int clients = argc > 2 ? atoi(argv[2]) : 200;
+    int size = argc > 3 ? atoi(argv[3]) : 256 * 1024;
+
+    UDSockServer server;
+    if (mode == "--arena" || mode == "--arena-lock")
+    {
+        // a grown buffer takes up to twice its size, the next power of two
+        server.EnableBufferArena(clients * (uint64_t)(size + 4096) * 4, mode == "--arena-lock");
+    }
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if (!server.Init(kServerAddress, std::bind(&do_sponse, std::placeholders::_1, std::placeholders::_2)))
+    {
+        perror("init");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    int64_t init_us = diff_us(begin, end);
+    std::thread loop(&UDSockServer::Run, &server);
+
+    std::vector<std::unique_ptr<UDSockClient>> conns;
+    for (int i = 0; i < clients; i++)
+    {
+        conns.push_back(std::unique_ptr<UDSockClient>(new UDSockClient()));
+        if (!conns.back()->Init(kServerAddress, []() {}))
+        {
+            perror("client init");
+            return 1;
+        }
+    }
+
+    // one request at a time, so the latency is the server's and not the queue's
+    std::string req(size, 'a');
+    std::vector<int64_t> costs;
+    for (auto& conn : conns)
+    {
+        std::atomic<bool> done(false);
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        conn->SendRequest(req, [&done](char*, uint64_t) { done = true; });
+        while (!done)
+            ;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        costs.push_back(diff_us(begin, end));
+    }
+    std::sort(costs.begin(), costs.end());
+    int64_t total = 0;
+    for (int64_t cost : costs)
+        total += cost;
+
+    std::cout << mode << " clients " << clients << " size " << size << " init " << init_us << " us, first request avg "
+        << total / clients << " us p50 " << costs[clients / 2] << " us max " << costs.back() << " us" << std::endl;
+    BufferArena::Stats stats;
+    if (server.GetArenaStats(stats))
+    {
+        std::cout << "arena " << (stats.hugetlb ? "hugetlb" : "thp") << (stats.locked ? " locked" : "") << " reserved " << stats.reserved
+            << " huge " << stats.huge_bytes << " (" << (stats.reserved ? stats.huge_bytes * 100 / stats.reserved : 0) << "%) in use "
+            << stats.in_use << " allocs " << stats.allocs << " fallbacks " << stats.fallbacks << std::endl;
+    }
+
+    for (auto& conn : conns)
+        conn->Stop();
+    server.Stop();
+    loop.join();
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include "poll_server.h"
+#include "poll_client.h"
+#include <unistd.h>
+#include <atomic>
+
+std::string do_sponse(char* data, uint64_t size)
+{
+    return std::string(data, size);
+}
+
+int64_t diff_us(struct timespec& start, struct timespec& end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000000 + ((end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+// one connection sending cnt requests of 1KB, returns once every response arrived
+void client_loop(int cnt, std::atomic<int>& failed)
+{
+    std::atomic<int> done(0);
+    UDSockClient client;
+    if (!client.Init(kServerAddress, []() {}))
+    {
+        failed += cnt;
+        return;
+    }
+    // with the blocking backend a client may wait for the previous one to leave
+    client.SetTimeout(0);
+    std::string req(1024, 'a');
+    for (int i = 0; i < cnt; i++)
+    {
+        if (client.SendRequest(0, req, [&done](char*, uint64_t) { done++; }, [&done, &failed](int) { done++; failed++; }) < 0)
+        {
+            done++;
+            failed++;
+        }
+    }
+    while (done.load() < cnt)
+        usleep(100);
+    client.Stop();
+}
+
+template <typename Backend>
+int bench(int clients, int requests)
+{
+    UDSockServer server;
+    if (!server.Init(kServerAddress, std::bind(&do_sponse, std::placeholders::_1, std::placeholders::_2)))
+    {
+        perror("init");
+        return 1;
+    }
+    std::thread loop(&UDSockServer::Serve<Backend>, &server);
+    usleep(100000);
+
+    struct timespec begin, end;
+    std::atomic<int> failed(0);
+    std::vector<std::thread> threads;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < clients; i++)
+    {
+        threads.push_back(std::thread(&client_loop, requests / clients, std::ref(failed)));
+    }
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    server.Stop();
+    loop.join();
+
+    int64_t us = diff_us(begin, end);
+    std::cout << Backend::Name() << ": clients " << clients << " requests " << requests / clients * clients
+        << " failed " << failed.load() << " spend " << us << " us, " << (us ? requests * 1000000LL / us : 0) << " req/s" << std::endl;
+    return 0;
+}
+
+// usage: test_backend [epoll|poll|blocking] [clients] [requests], the backend is a template argument
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    std::string backend = argc > 1 ? argv[1] : "epoll";
+    int clients = argc > 2 ? atoi(argv[2]) : 4;
+    int requests = argc > 3 ? atoi(argv[3]) : 400000;
+    if (backend == "epoll")
+        return bench<EpollBackend>(clients, requests);
+    if (backend == "poll")
+        return bench<PollBackend>(clients, requests);
+    if (backend == "blocking")
+        return bench<BlockingBackend>(clients, requests);
+    std::cerr << "unknown backend " << backend << std::endl;
+    return 1;
+}
@@ -0,0 +1,99 @@
+#include "poll_server.h"
+#include "poll_client.h"
+#include <unistd.h>
+#include <atomic>
+
+// an index shared with other threads, every lookup has to hold its lock
+struct Index
+{
+    std::mutex lock;
+    std::vector<std::string> values;
+
+    Index(size_t count) : values(count)
+    {
+        for (size_t i = 0; i < count; i++)
+            values[i] = "value-" + std::to_string(i);
+    }
+};
+
+Index g_index(1 << 20);
+
+std::string lookup(char* data, uint64_t size)
+{
+    uint64_t key = 0;
+    memcpy(&key, data, size < 8 ? size : 8);
+    std::lock_guard<std::mutex> _(g_index.lock);
+    return g_index.values[key % g_index.values.size()];
+}
+
+void lookup_batch(const UDSockServer::RequestView* reqs, size_t count, std::string* resps)
+{
+    // one lock for the batch, and the slots are touched ahead of the copies
+    std::vector<const std::string*> slots(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t key = 0;
+        memcpy(&key, reqs[i].data, reqs[i].size < 8 ? reqs[i].size : 8);
+        slots[i] = &g_index.values[key % g_index.values.size()];
+        __builtin_prefetch(slots[i]);
+    }
+    std::lock_guard<std::mutex> _(g_index.lock);
+    for (size_t i = 0; i < count; i++)
+        resps[i] = *slots[i];
+}
+
+int64_t diff_us(struct timespec& start, struct timespec& end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000000 + ((end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+// usage: test_batch [requests], pipelines lookups of random keys to a per-frame handler
+// (method 1) and to the same lookup as a batch handler (method 2)
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int requests = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    UDSockServer server;
+    server.RegisterMethod<&lookup>(1);
+    server.RegisterBatchMethod(2, &lookup_batch);
+    if (!server.Init(kServerAddress, &lookup))
+    {
+        perror("init");
+        return 1;
+    }
+    std::thread loop(&UDSockServer::Run, &server);
+
+    UDSockClient client;
+    if (!client.Init(kServerAddress, []() {}))
+    {
+        perror("client init");
+        return 1;
+    }
+    for (uint16_t method = 1; method <= 2; method++)
+    {
+        std::atomic<int> answered(0);
+        unsigned int seed = 1;
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for (int i = 0; i < requests; i++)
+        {
+            uint64_t key = rand_r(&seed);
+            std::string req((char*)&key, sizeof(key));
+            client.SendRequest(method, req, [&answered](char*, uint64_t) { answered++; });
+        }
+        while (answered.load() < requests)
+            usleep(100);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        UDSockServer::MethodStats stats;
+        server.GetMethodStats(method, stats);
+        std::cout << (method == 1 ? "per frame " : "batch     ") << diff_us(begin, end) << " us, handler "
+            << stats.total_ns / (stats.calls ? stats.calls : 1) << " ns per request" << std::endl;
+    }
+
+    client.Stop();
+    server.Stop();
+    loop.join();
+    return 0;
+}
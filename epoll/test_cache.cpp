@@ -0,0 +1,113 @@
+#include "poll_server.h"
+#include "poll_client.h"
+#include <unistd.h>
+#include <atomic>
+
+std::atomic<int> g_version(0);
+std::atomic<int> g_calls(0);
+std::atomic<bool> g_inside(false);
+std::atomic<bool> g_go(true);
+
+std::string do_version(char*, uint64_t)
+{
+    g_calls++;
+    std::string version = std::to_string(g_version.load());
+    // the race test holds the handler here after it read the old data
+    g_inside = true;
+    while (!g_go)
+        usleep(100);
+    g_inside = false;
+    return version;
+}
+
+std::string do_sponse(char* data, uint64_t size)
+{
+    return std::string(data, size);
+}
+
+// the response to one request of method, empty when it failed
+std::string call(UDSockClient& client, uint16_t method, const std::string& body)
+{
+    std::atomic<bool> done(false);
+    std::string resp, req = body;
+    client.SendRequest(method, req, [&](char* data, uint64_t size) { resp.assign(data, size); done = true; },
+        [&](int) { done = true; });
+    while (!done)
+        usleep(100);
+    return resp;
+}
+
+bool expect(const char* what, bool ok)
+{
+    std::cout << (ok ? "ok   " : "FAIL ") << what << std::endl;
+    return ok;
+}
+
+// usage: test_cache, a cached method is served without its handler, expires with its TTL
+// and answers fresh data after an invalidation, also one that lands while the handler runs
+int main()
+{
+    signal(SIGPIPE, SIG_IGN);
+    UDSockServer server;
+    server.RegisterMethod<&do_version>(1);
+    server.RegisterMethod<&do_version>(2);
+    server.SetCacheable(1, 0);
+    server.SetCacheable(2, 50);
+    if (!server.Init(kServerAddress, std::bind(&do_sponse, std::placeholders::_1, std::placeholders::_2)))
+    {
+        perror("init");
+        return 1;
+    }
+    std::thread loop(&UDSockServer::Run, &server);
+    UDSockClient client;
+    if (!client.Init(kServerAddress, []() {}))
+    {
+        perror("client init");
+        return 1;
+    }
+
+    bool ok = true;
+    g_calls = 0;
+    call(client, 1, "k");
+    std::string hit = call(client, 1, "k");
+    ok &= expect("second request is a hit", g_calls == 1 && hit == "0");
+    call(client, 1, "other");
+    ok &= expect("another request misses", g_calls == 2);
+
+    g_calls = 0;
+    call(client, 2, "k");
+    call(client, 2, "k");
+    usleep(100 * 1000);
+    call(client, 2, "k");
+    ok &= expect("expired after its ttl", g_calls == 2);
+
+    g_version = 1;
+    server.InvalidateCache(1, "k");
+    ok &= expect("invalidated request is served fresh", call(client, 1, "k") == "1");
+    g_version = 2;
+    server.InvalidateCache(1);
+    ok &= expect("invalidated method is served fresh", call(client, 1, "k") == "2" && call(client, 1, "other") == "2");
+
+    // the handler reads version 2, the data changes and is invalidated before it returns
+    g_go = false;
+    std::atomic<bool> done(false);
+    std::string req("race");
+    client.SendRequest(1, req, [&](char*, uint64_t) { done = true; });
+    while (!g_inside)
+        usleep(100);
+    g_version = 3;
+    server.InvalidateCache(1);
+    g_go = true;
+    while (!done)
+        usleep(100);
+    ok &= expect("response computed before an invalidation is not cached", call(client, 1, "race") == "3");
+
+    ResponseCache::Stats stats;
+    server.GetCacheStats(stats);
+    std::cout << "hits " << stats.hits << " misses " << stats.misses << " entries " << stats.entries << std::endl;
+
+    client.Stop();
+    server.Stop();
+    loop.join();
+    return ok ? 0 : 1;
+}
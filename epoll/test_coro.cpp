@@ -0,0 +1,94 @@
+#include "poll_client_coro.h"
+#include <unistd.h>
+#include <assert.h>
+#include <atomic>
+#include <deque>
+
+std::atomic<int> g_done(0);
+std::atomic<int> g_failed(0);
+
+void disconn_event()
+{
+    std::cout << "server quit...!!!" << std::endl;
+}
+
+int64_t diff_us(struct timespec& start, struct timespec& end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000000 + ((end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+// resumes coroutines on one worker thread instead of the client receive thread
+class WorkQueue
+{
+public:
+    void Post(std::coroutine_handle<> handle)
+    {
+        std::lock_guard<std::mutex> _(lock_);
+        ready_.push_back(handle);
+        cv_.notify_one();
+    }
+
+    void Loop(int total)
+    {
+        while (g_done.load() < total)
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            cv_.wait_for(lock, std::chrono::milliseconds(10), [this]() { return !ready_.empty(); });
+            std::deque<std::coroutine_handle<>> ready;
+            ready.swap(ready_);
+            lock.unlock();
+            for (auto handle : ready)
+                handle.resume();
+        }
+    }
+
+private:
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::deque<std::coroutine_handle<>> ready_;
+};
+
+// one logical caller, its calls run one after another
+CoroTask caller(CoroClient& client, int calls)
+{
+    std::string req(1024, 'a');
+    for (int i = 0; i < calls; i++)
+    {
+        CallResult res = co_await client.Call(req);
+        if (res.err)
+            g_failed++;
+        else
+            assert(res.data == req);
+    }
+    g_done++;
+}
+
+// usage: test_coro [callers] [calls per caller]
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int callers = argc > 1 ? atoi(argv[1]) : 20000;
+    int calls = argc > 2 ? atoi(argv[2]) : 50;
+    struct timespec begin, end;
+    UDSockClient client;
+    if (!client.Init(kServerAddress, &disconn_event))
+    {
+        perror("Init");
+        return -1;
+    }
+    client.SetTimeout(0);
+
+    WorkQueue queue;
+    CoroClient coro(client, [&queue](std::coroutine_handle<> handle) { queue.Post(handle); });
+    clock_gettime(CLOCK_REALTIME, &begin);
+    for (int i = 0; i < callers; i++)
+    {
+        caller(coro, calls);
+    }
+    queue.Loop(callers);
+    clock_gettime(CLOCK_REALTIME, &end);
+    std::cout << "callers: " << callers << " calls: " << (uint64_t)callers * calls << " failed: " << g_failed.load()
+        << " spend: " << diff_us(begin, end) << " us" << std::endl;
+    client.Stop();
+    return 0;
+}
@@ -0,0 +1,182 @@
+#include "poll_server.h"
+#include "poll_balancer.h"
+#include <unistd.h>
+#include <atomic>
+#include <set>
+
+const int kSlowMs = 50;
+const char* kPaths[2] = {"/tmp/unix_hedge0.sock", "/tmp/unix_hedge1.sock"};
+
+std::mutex g_lock;
+std::set<std::string> g_seen;
+std::vector<std::thread> g_delayed;
+std::atomic<int> g_loser_cancelled(0);
+std::atomic<int> g_slow_replied(0);
+
+std::string do_sponse(char* data, uint64_t size)
+{
+    return std::string(data, size);
+}
+
+// a request starting with 's' is slow on whichever endpoint sees it first, its hedged
+// copy is answered at once by the other one
+void do_hedged(char* data, uint64_t size, const UDSockServer::Responder& responder)
+{
+    std::string body(data, size);
+    std::lock_guard<std::mutex> _(g_lock);
+    UDSockServer::Responder reply = responder;
+    if (body[0] != 's' || !g_seen.insert(body).second)
+    {
+        reply.Reply(body);
+        return;
+    }
+    g_delayed.push_back(std::thread([reply, body]() mutable {
+        usleep(kSlowMs * 1000);
+        if (reply.Cancelled())
+            g_loser_cancelled++;
+        else
+            g_slow_replied++;
+        reply.Reply(body);
+    }));
+}
+
+struct Result
+{
+    std::atomic<int> responses;
+    std::atomic<int> errors;
+    struct timespec begin;
+    int64_t us;
+
+    Result() : responses(0), errors(0), us(0) {}
+};
+
+int64_t diff_us(struct timespec& start, struct timespec& end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000000 + ((end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+void send(UDSockBalancer& balancer, const std::string& body, Result& result)
+{
+    std::string req = body;
+    clock_gettime(CLOCK_MONOTONIC, &result.begin);
+    balancer.SendRequest(1, req, [&result](char*, uint64_t) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        result.us = diff_us(result.begin, end);
+        result.responses++;
+    }, [&result](int) { result.errors++; });
+}
+
+// fast requests one at a time until the balancer knows a hedge delay
+void warm_up(UDSockBalancer& balancer, int requests)
+{
+    for (int i = 0; i < requests; i++)
+    {
+        Result result;
+        send(balancer, "fast", result);
+        while (!result.responses && !result.errors)
+            usleep(50);
+    }
+    // the monitor turns the latencies into a delay every 50ms
+    usleep(150 * 1000);
+}
+
+bool expect(const char* what, bool ok)
+{
+    std::cout << (ok ? "ok   " : "FAIL ") << what << std::endl;
+    return ok;
+}
+
+// usage: test_hedge, a request stuck on a slow endpoint is hedged to the other one, the
+// copy wins, the loser is cancelled on the server and the caller gets one result. Then
+// a burst of slow requests gets no more copies than the budget allows
+int main()
+{
+    signal(SIGPIPE, SIG_IGN);
+    std::vector<std::unique_ptr<UDSockServer>> servers;
+    std::vector<std::thread> loops;
+    for (auto path : kPaths)
+    {
+        servers.push_back(std::unique_ptr<UDSockServer>(new UDSockServer()));
+        servers.back()->RegisterAsyncMethod(1, &do_hedged);
+        if (!servers.back()->Init(path, std::bind(&do_sponse, std::placeholders::_1, std::placeholders::_2)))
+        {
+            perror("init");
+            return 1;
+        }
+        loops.push_back(std::thread(&UDSockServer::Run, servers.back().get()));
+    }
+    std::vector<std::string> paths(kPaths, kPaths + 2);
+    bool ok = true;
+
+    {
+        UDSockBalancer balancer;
+        if (!balancer.Init(paths, []() {}))
+        {
+            perror("balancer init");
+            return 1;
+        }
+        balancer.SetHedging(90, 100);
+        warm_up(balancer, 200);
+
+        const int slow = 10;
+        uint64_t wins = balancer.HedgeWins();
+        Result results[slow];
+        for (int i = 0; i < slow; i++)
+        {
+            send(balancer, "slow-" + std::to_string(i), results[i]);
+            while (!results[i].responses && !results[i].errors)
+                usleep(50);
+        }
+        // long enough for every loser to reach its reply
+        usleep(3 * kSlowMs * 1000);
+        bool once = true, fast = true;
+        for (auto& result : results)
+        {
+            once &= result.responses == 1 && result.errors == 0;
+            fast &= result.us < kSlowMs * 1000;
+        }
+        ok &= expect("slow requests are answered by their hedge", fast && balancer.HedgeWins() - wins == slow);
+        ok &= expect("every loser is cancelled on the server", g_loser_cancelled == slow && g_slow_replied == 0);
+        ok &= expect("exactly one result per request", once);
+        balancer.Stop();
+    }
+
+    {
+        UDSockBalancer balancer;
+        balancer.Init(paths, []() {});
+        const uint32_t budget = 10;
+        balancer.SetHedging(90, budget);
+        const int warm = 200;
+        warm_up(balancer, warm);
+        uint64_t before = balancer.HedgeCount();
+
+        const int burst = 100;
+        Result results[burst];
+        for (int i = 0; i < burst; i++)
+        {
+            send(balancer, "slow-burst-" + std::to_string(i), results[i]);
+        }
+        usleep(4 * kSlowMs * 1000);
+        int answered = 0, once = 0;
+        for (auto& result : results)
+        {
+            answered += result.responses > 0;
+            once += result.responses == 1 && result.errors == 0;
+        }
+        uint64_t hedges = balancer.HedgeCount();
+        std::cout << "burst of " << burst << " slow requests got " << hedges - before << " hedges, "
+            << hedges << " in all for " << warm + burst << " requests at a budget of " << budget << "%" << std::endl;
+        ok &= expect("the budget caps the copies", hedges <= (warm + burst) * budget / 100 + 1 && hedges - before > 0);
+        ok &= expect("every request of the burst answered once", answered == burst && once == burst);
+        balancer.Stop();
+    }
+
+    for (auto& server : servers)
+        server->Stop();
+    for (auto& loop : loops)
+        loop.join();
+    for (auto& delayed : g_delayed)
+        delayed.join();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+#include "poll_server.h"
+#include "poll_client.h"
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <algorithm>
+
+const std::string kCtrlAddress = "/tmp/unix.sock.ctrl";
+
+std::string do_sponse(char* data, uint64_t size)
+{
+    return std::string(data, size);
+}
+
+int64_t diff_us(struct timespec& start, struct timespec& end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000000 + ((end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+// the server side, run in a child: "serve" starts fresh, "takeover" replaces the running one
+int serve(bool takeover)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    UDSockServer server;
+    bool ok = takeover ? server.TakeOver(kCtrlAddress, kServerAddress, std::bind(&do_sponse, std::placeholders::_1, std::placeholders::_2))
+        : server.Init(kServerAddress, std::bind(&do_sponse, std::placeholders::_1, std::placeholders::_2));
+    if (!ok)
+    {
+        return 1;
+    }
+    server.EnableHotRestart(kCtrlAddress);
+    // SIGTERM is a cold stop, a hand-over ends Run() by itself
+    std::thread([&server, set]() {
+        int sig;
+        sigwait(&set, &sig);
+        server.Stop();
+    }).detach();
+    server.Run();
+    return 0;
+}
+
+pid_t spawn(const char* self, const char* mode)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execl(self, self, mode, (char*)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+// usage: test_hotrestart [clients] [restarts] [--cold], clients send requests back to back
+// while the server is replaced every 300ms, by a hot restart or with --cold by stopping it
+// and starting a new one. Reports failed requests, disconnects and the latency tail
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    if (argc > 1 && (std::string(argv[1]) == "serve" || std::string(argv[1]) == "takeover"))
+    {
+        return serve(std::string(argv[1]) == "takeover");
+    }
+    int clients = argc > 1 ? atoi(argv[1]) : 8;
+    int restarts = argc > 2 ? atoi(argv[2]) : 5;
+    bool cold = argc > 3 && std::string(argv[3]) == "--cold";
+
+    pid_t server = spawn(argv[0], "serve");
+    while (access(kCtrlAddress.c_str(), F_OK) != 0)
+        usleep(1000);
+
+    std::atomic<int> disconnects(0);
+    std::vector<std::unique_ptr<UDSockClient>> conns;
+    for (int i = 0; i < clients; i++)
+    {
+        conns.push_back(std::unique_ptr<UDSockClient>(new UDSockClient()));
+        if (!conns.back()->Init(kServerAddress, [&disconnects]() { disconnects++; }))
+        {
+            perror("client init");
+            return 1;
+        }
+    }
+
+    std::atomic<bool> running(true);
+    std::atomic<uint64_t> failed(0);
+    std::vector<std::vector<int64_t>> costs(clients);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < clients; i++)
+    {
+        workers.push_back(std::thread([&, i]() {
+            std::string req(64, 'a');
+            while (running)
+            {
+                std::atomic<int> done(0);
+                struct timespec begin, end;
+                clock_gettime(CLOCK_MONOTONIC, &begin);
+                int ret = conns[i]->SendRequest(0, req, [&done](char*, uint64_t) { done = 1; },
+                    [&done](int) { done = 2; });
+                if (ret < 0)
+                {
+                    failed++;
+                    usleep(1000);
+                    continue;
+                }
+                while (!done)
+                    usleep(20);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                if (done == 2)
+                    failed++;
+                else
+                    costs[i].push_back(diff_us(begin, end));
+            }
+        }));
+    }
+
+    int64_t switch_max = 0;
+    for (int r = 0; r < restarts; r++)
+    {
+        usleep(300 * 1000);
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        if (cold)
+        {
+            kill(server, SIGTERM);
+            waitpid(server, NULL, 0);
+            server = spawn(argv[0], "serve");
+        }
+        else
+        {
+            pid_t next = spawn(argv[0], "takeover");
+            waitpid(server, NULL, 0);
+            server = next;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        switch_max = std::max(switch_max, diff_us(begin, end));
+    }
+    usleep(300 * 1000);
+
+    running = false;
+    for (auto& worker : workers)
+        worker.join();
+    for (auto& conn : conns)
+        conn->Stop();
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+
+    std::vector<int64_t> all;
+    for (auto& cost : costs)
+        all.insert(all.end(), cost.begin(), cost.end());
+    std::sort(all.begin(), all.end());
+    if (all.empty())
+        all.push_back(0);
+    std::cout << (cold ? "cold" : "hot") << " restarts " << restarts << " requests " << all.size() << " failed " << failed.load()
+        << " disconnects " << disconnects.load() << " p50 " << all[all.size() / 2] << " us p99 " << all[all.size() * 99 / 100]
+        << " us max " << all.back() << " us, slowest switch " << switch_max << " us" << std::endl;
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "poll_server_numa.h"
+#include "poll_client.h"
+#include "numa_topology.h"
+#include <unistd.h>
+#include <atomic>
+
+std::string do_sponse(char* data, uint64_t size)
+{
+    return std::string(data, size);
+}
+
+int64_t diff_us(struct timespec& start, struct timespec& end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000000 + ((end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+// requests from a client whose threads all run on client_node, -1 on failure
+int64_t run_client(int client_node, int requests, const std::string& req)
+{
+    // the receive thread started by Init() inherits the binding
+    cpu_set_t saved;
+    pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved);
+    NumaTopology::Get().BindThread(client_node);
+
+    int64_t spend = -1;
+    UDSockClient client;
+    if (client.Init(kServerAddress, []() {}))
+    {
+        std::atomic<int> answered(0);
+        std::string body = req;
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for (int i = 0; i < requests; i++)
+        {
+            client.SendRequest(body, [&answered](char*, uint64_t) { answered++; });
+        }
+        while (answered.load() < requests)
+            usleep(100);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        spend = diff_us(begin, end);
+        client.Stop();
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+    return spend;
+}
+
+// usage: test_numa [requests] [size], echoes with the server loop and the client on every
+// pair of nodes to show what a remote loop costs, then checks that UDSockNumaServer
+// serves each client on the loop of its own node
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int requests = argc > 1 ? atoi(argv[1]) : 100000;
+    int size = argc > 2 ? atoi(argv[2]) : 4096;
+    std::string req(size, 'a');
+    const std::vector<int>& nodes = NumaTopology::Get().Nodes();
+    std::cout << "nodes " << nodes.size() << ", " << requests << " requests of " << size << " bytes" << std::endl;
+    if (nodes.size() < 2)
+    {
+        std::cout << "one node only, local and remote cannot be told apart here" << std::endl;
+    }
+
+    for (int server_node : nodes)
+    {
+        for (int client_node : nodes)
+        {
+            UDSockServer server(size + 1024);
+            server.SetNumaNode(server_node);
+            if (!server.Init(kServerAddress, std::bind(&do_sponse, std::placeholders::_1, std::placeholders::_2)))
+            {
+                perror("init");
+                return 1;
+            }
+            std::thread loop(&UDSockServer::Run, &server);
+            int64_t spend = run_client(client_node, requests, req);
+            server.Stop();
+            loop.join();
+            std::cout << "loop on node " << server_node << ", client on node " << client_node << (server_node == client_node ? " (local)  " : " (remote) ")
+                << spend << " us, " << (spend > 0 ? requests * 1000000LL / spend : 0) << " req/s" << std::endl;
+        }
+    }
+
+    UDSockNumaServer numa(size + 1024);
+    if (!numa.Init(kServerAddress, std::bind(&do_sponse, std::placeholders::_1, std::placeholders::_2)))
+    {
+        perror("numa init");
+        return 1;
+    }
+    std::thread loop(&UDSockNumaServer::Run, &numa);
+    usleep(10000);
+    for (int client_node : nodes)
+    {
+        run_client(client_node, requests / 10, req);
+    }
+    for (size_t i = 0; i < numa.Loops(); i++)
+    {
+        UDSockServer::MethodStats stats;
+        if (!numa.Loop(i).GetMethodStats(0, stats))
+            stats.calls = 0;
+        std::cout << "routed: loop on node " << numa.Node(i) << " served " << stats.calls << " requests" << std::endl;
+    }
+    numa.Stop();
+    loop.join();
+    return 0;
+}
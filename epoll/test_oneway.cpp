@@ -0,0 +1,79 @@
+#include "poll_server.h"
+#include "poll_client.h"
+#include <unistd.h>
+#include <atomic>
+
+std::atomic<uint64_t> g_received(0);
+
+std::string do_count(char*, uint64_t)
+{
+    g_received++;
+    return std::string();
+}
+
+std::string do_sponse(char* data, uint64_t size)
+{
+    return std::string(data, size);
+}
+
+// usage: test_oneway [messages], two clients of one process interleave one-way messages
+// to a server checking their sequences, no gap may be reported
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int messages = argc > 1 ? atoi(argv[1]) : 100000;
+
+    std::atomic<uint64_t> gaps(0);
+    UDSockServer server;
+    server.RegisterMethod<&do_count>(1);
+    server.EnableSeqCheck([&gaps](pid_t pid, uint64_t expect, uint64_t recv) {
+        if (gaps++ < 5)
+            std::cout << "gap from pid " << pid << ": expected " << expect << " got " << recv << std::endl;
+    });
+    if (!server.Init(kServerAddress, std::bind(&do_sponse, std::placeholders::_1, std::placeholders::_2)))
+    {
+        perror("init");
+        return 1;
+    }
+    std::thread loop(&UDSockServer::Run, &server);
+
+    UDSockClient clients[2];
+    for (auto& client : clients)
+    {
+        if (!client.Init(kServerAddress, []() {}))
+        {
+            perror("client init");
+            return 1;
+        }
+    }
+    // at different rates, so the sequences of the two drift apart
+    std::string msg(64, 'm');
+    for (int i = 0; i < messages; i++)
+    {
+        if (clients[i % 3 == 0].SendOneWay(1, msg) < 0)
+        {
+            perror("send one way");
+            return 1;
+        }
+    }
+
+    // a connection is served in order, the answer comes after its one-way frames ran
+    std::atomic<int> answered(0);
+    std::string req("sync");
+    for (auto& client : clients)
+    {
+        client.SendRequest(req, [&answered](char*, uint64_t) { answered++; });
+    }
+    while (answered.load() < 2)
+        usleep(100);
+
+    std::cout << "sent " << messages << " received " << g_received.load() << " lost " << server.OneWayLost()
+        << " gaps " << gaps.load() << std::endl;
+    bool ok = g_received.load() == (uint64_t)messages && server.OneWayLost() == 0 && gaps.load() == 0;
+
+    for (auto& client : clients)
+        client.Stop();
+    server.Stop();
+    loop.join();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,71 @@
+#include "poll_client_pool.h"
+#include <unistd.h>
+#include <assert.h>
+#include <atomic>
+
+std::atomic<int> g_req_cnt(0);
+
+void disconn_event()
+{
+    std::cout << "server quit...!!!" << std::endl;
+}
+
+int64_t diff_us(struct timespec& start, struct timespec& end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000000 + ((end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+void do_respone(char*, uint64_t size)
+{
+    g_req_cnt++;
+    assert(size == 1024);
+}
+
+void loop_send(UDSockClientPool& pool, int cnt)
+{
+    std::string req(1024, 'a');
+    for (int i = 0; i < cnt; i++)
+    {
+        pool.SendRequest(req, do_respone);
+    }
+}
+
+// usage: test_pool [connections] [threads]
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int conns = argc > 1 ? atoi(argv[1]) : 4;
+    int th_nums = argc > 2 ? atoi(argv[2]) : 4;
+    try
+    {
+        struct timespec begin, end;
+        UDSockClientPool pool(conns);
+        if (!pool.Init(kServerAddress, &disconn_event))
+        {
+            perror("Init");
+            return -1;
+        }
+        int max_cnt = 1000000;
+        std::vector<std::thread> threads;
+        clock_gettime(CLOCK_REALTIME, &begin);
+        for (int i = 0; i < th_nums; i++)
+        {
+            threads.push_back(std::thread(&loop_send, std::ref(pool), max_cnt / th_nums));
+        }
+        for (auto& th : threads)
+        {
+            th.join();
+        }
+        while(g_req_cnt.load() < max_cnt / th_nums * th_nums)
+            usleep(1000);
+        clock_gettime(CLOCK_REALTIME, &end);
+        std::cout << "connections: " << conns << " threads: " << th_nums << " spend: " << diff_us(begin, end) << " us" << std::endl;
+        pool.Stop();
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << '\n';
+    }
+
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include "poll_server.h"
+#include "poll_client.h"
+#include <unistd.h>
+#include <atomic>
+
+std::string do_sponse(char* data, uint64_t size)
+{
+    return std::string(data, size);
+}
+
+int64_t diff_us(struct timespec& start, struct timespec& end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000000 + ((end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+bool start_server(UDSockServer& server, std::thread& loop, int backlog)
+{
+    server.SetBacklog(backlog);
+    if (!server.Init(kServerAddress, std::bind(&do_sponse, std::placeholders::_1, std::placeholders::_2)))
+    {
+        perror("init");
+        return false;
+    }
+    loop = std::thread(&UDSockServer::Run, &server);
+    return true;
+}
+
+// usage: test_reconnect [clients] [backlog], connects the clients, restarts the server and
+// reports how long it takes until every client is connected again and got a response
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int clients = argc > 1 ? atoi(argv[1]) : 500;
+    int backlog = argc > 2 ? atoi(argv[2]) : kListenBacklog;
+
+    std::thread loop;
+    std::unique_ptr<UDSockServer> server(new UDSockServer());
+    if (!start_server(*server, loop, backlog))
+    {
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<UDSockClient>> conns;
+    for (int i = 0; i < clients; i++)
+    {
+        conns.push_back(std::unique_ptr<UDSockClient>(new UDSockClient()));
+        if (!conns.back()->Init(kServerAddress, []() {}))
+        {
+            perror("client init");
+            return 1;
+        }
+        conns.back()->SetTimeout(0);
+    }
+
+    // wait for the loop to serve every client before pulling it away
+    std::atomic<int> answered(0), failed(0);
+    std::string req(64, 'a');
+    auto on_resp = [&answered](char*, uint64_t) { answered++; };
+    auto on_error = [&answered, &failed](int) { answered++; failed++; };
+    for (auto& conn : conns)
+    {
+        if (conn->SendRequest(0, req, on_resp, on_error) < 0)
+            on_error(-1);
+    }
+    while (answered.load() < clients)
+        usleep(100);
+
+    // every client sees the hang-up and starts its reconnect backoff
+    server->Stop();
+    loop.join();
+    server.reset(new UDSockServer());
+
+    struct timespec begin, connected, served;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if (!start_server(*server, loop, backlog))
+    {
+        return 1;
+    }
+
+    answered = 0;
+    failed = 0;
+    std::vector<bool> sent(clients, false);
+    int up = 0, pending = clients;
+    while (pending > 0)
+    {
+        for (int i = 0; i < clients; i++)
+        {
+            if (sent[i] || !conns[i]->IsConnected())
+                continue;
+            if (conns[i]->SendRequest(0, req, on_resp, on_error) == 0)
+            {
+                sent[i] = true;
+                pending--;
+                if (++up == clients)
+                    clock_gettime(CLOCK_MONOTONIC, &connected);
+            }
+        }
+        usleep(100);
+    }
+    while (answered.load() < clients)
+        usleep(100);
+    clock_gettime(CLOCK_MONOTONIC, &served);
+
+    std::cout << "clients " << clients << " backlog " << backlog << " all connected " << diff_us(begin, connected) 
+        << " us, all answered " << diff_us(begin, served) << " us, failed " << failed.load() << std::endl;
+
+    for (auto& conn : conns)
+        conn->Stop();
+    server->Stop();
+    loop.join();
+    return 0;
+}
@@ -0,0 +1,237 @@
+#ifndef _TIMER_WHEEL_
+#define _TIMER_WHEEL_
+#include <stdint.h>
+#include <limits.h>
+
+// intrusive node, embed it in the object that owns the timeout
+struct TimerNode
+{
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    uint64_t expire = 0;    // absolute tick
+    uint64_t data = 0;      // owner defined, e.g. a request id
+
+    TimerNode() {}
+
+    // a copy is never linked into the wheel
+    TimerNode(const TimerNode& other) : expire(other.expire), data(other.data) {}
+
+    TimerNode& operator=(const TimerNode& other)
+    {
+        expire = other.expire;
+        data = other.data;
+        return *this;
+    }
+
+    inline bool Linked() const
+    {
+        return next != nullptr;
+    }
+};
+
+// hierarchical timing wheel: kLevels levels of kSlots slots, level n slots span kSlots^n ticks.
+// Add, Cancel and expiring a timer are O(1), timers further out than the wheel
+// covers are parked in the last slot and re-sorted when it comes round.
+class TimerWheel
+{
+    static const int kBits = 6;
+    static const int kSlots = 1 << kBits;
+    static const int kLevels = 4;
+    static const uint64_t kMask = kSlots - 1;
+
+public:
+    TimerWheel() : now_(0), count_(0)
+    {
+        for (int l = 0; l < kLevels; l++)
+            for (int s = 0; s < kSlots; s++)
+                slots_[l][s].prev = slots_[l][s].next = &slots_[l][s];
+    }
+
+    // the wheel starts at tick now, call once before the first Add
+    void Reset(uint64_t now)
+    {
+        Clear();
+        now_ = now;
+    }
+
+    void Add(TimerNode* node, uint64_t expire)
+    {
+        if (node->Linked())
+        {
+            Cancel(node);
+        }
+        node->expire = expire < now_ ? now_ : expire;
+        Link(node);
+        count_++;
+    }
+
+    void Cancel(TimerNode* node)
+    {
+        if (!node->Linked())
+        {
+            return;
+        }
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+        count_--;
+    }
+
+    // unlink every timer without firing it
+    void Clear()
+    {
+        Clear([](TimerNode*) {});
+    }
+
+    // same, on_node(node) is called once the node is unlinked so it may free it
+    template <typename F>
+    void Clear(F on_node)
+    {
+        for (int l = 0; l < kLevels; l++)
+        {
+            for (int s = 0; s < kSlots; s++)
+            {
+                TimerNode* head = &slots_[l][s];
+                while (head->next != head)
+                {
+                    TimerNode* node = head->next;
+                    head->next = node->next;
+                    node->prev = node->next = nullptr;
+                    on_node(node);
+                }
+                head->prev = head;
+            }
+        }
+        count_ = 0;
+    }
+
+    // move the wheel to tick now, on_expire(node) is called for every due timer,
+    // the node is already unlinked so the callback may free it
+    template <typename F>
+    void Advance(uint64_t now, F on_expire)
+    {
+        if (count_ == 0)
+        {
+            now_ = now > now_ ? now : now_;
+            return;
+        }
+        while (now_ <= now)
+        {
+            // cascade higher levels into lower ones when a lower level wraps
+            for (int l = 1; l < kLevels; l++)
+            {
+                if ((now_ >> (kBits * l)) << (kBits * l) != now_)
+                    break;
+                Cascade(l, (now_ >> (kBits * l)) & kMask);
+            }
+
+            TimerNode* head = &slots_[0][now_ & kMask];
+            while (head->next != head)
+            {
+                TimerNode* node = head->next;
+                Cancel(node);
+                on_expire(node);
+            }
+
+            if (count_ == 0)
+            {
+                now_ = now + 1;
+                break;
+            }
+            now_++;
+        }
+    }
+
+    uint64_t Size() const
+    {
+        return count_;
+    }
+
+    // earliest tick Advance() may have work at: a due timer, or a cascade that may bring one
+    // down a level. Waking up then never misses a timer. UINT64_MAX when the wheel is empty
+    uint64_t NextTick() const
+    {
+        if (count_ == 0)
+        {
+            return UINT64_MAX;
+        }
+        uint64_t next = UINT64_MAX;
+        for (int l = kLevels - 1; l > 0; l--)
+        {
+            for (int s = 0; s < kSlots; s++)
+            {
+                if (slots_[l][s].next != &slots_[l][s])
+                {
+                    // slots of level l cascade on multiples of kSlots^l
+                    uint64_t span = 1ULL << (kBits * l);
+                    next = (now_ + span - 1) & ~(span - 1);
+                    break;
+                }
+            }
+        }
+        for (uint64_t t = now_; t < now_ + kSlots && t < next; t++)
+        {
+            if (slots_[0][t & kMask].next != &slots_[0][t & kMask])
+            {
+                return t;
+            }
+        }
+        return next;
+    }
+
+private:
+    void Link(TimerNode* node)
+    {
+        uint64_t delta = node->expire - now_;
+        int level = 0;
+        while (level < kLevels - 1 && delta >= (uint64_t)kSlots << (kBits * level))
+        {
+            level++;
+        }
+        uint64_t slot;
+        if (level == kLevels - 1 && delta >= (uint64_t)kSlots << (kBits * level))
+        {
+            // beyond the wheel range, park one full turn ahead and re-sort on cascade
+            slot = ((now_ >> (kBits * level)) - 1) & kMask;
+        }
+        else
+        {
+            slot = (node->expire >> (kBits * level)) & kMask;
+        }
+
+        TimerNode* head = &slots_[level][slot];
+        node->next = head;
+        node->prev = head->prev;
+        head->prev->next = node;
+        head->prev = node;
+    }
+
+    void Cascade(int level, uint64_t slot)
+    {
+        TimerNode* head = &slots_[level][slot];
+        TimerNode list;
+        if (head->next == head)
+        {
+            return;
+        }
+        // detach the slot, then re-insert every node relative to the current tick
+        list.next = head->next;
+        list.prev = head->prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        head->prev = head->next = head;
+        while (list.next != &list)
+        {
+            TimerNode* node = list.next;
+            list.next = node->next;
+            node->next->prev = &list;
+            Link(node);
+        }
+    }
+
+    TimerNode slots_[kLevels][kSlots];
+    uint64_t now_;
+    uint64_t count_;
+};
+
+#endif // _TIMER_WHEEL_
@@ -1,5 +1,4 @@
 #include <unistd.h>
-#include <poll.h>
 #include <sys/un.h>
 #include <errno.h>
 #include <assert.h>
@@ -65,83 +64,85 @@ bool UDSockServer::Init(const std::string& server_addr, const RequestCbk& on_req
     return true;
 }
 
-bool UDSockServer::Accept(struct pollfd* fds, int& maxi, Buffer* buffs)
+bool UDSockServer::Accept(PollBackend& backend, std::unordered_map<int, Connection*>& conns, std::vector<Buffer>& spare)
 {
-    int pos = -1;
-    int cfd = accept(fds[0].fd, NULL, NULL);
+    int cfd = accept(lis_sock_, NULL, NULL);
     if (cfd == -1) 
     {
         LOG_OUT("accept failed", strerror(errno));
         return false;
     }
 
-    int i = 1;
-    for (; i < kMaxFiles; i++)
-    {
-        if (fds[i].fd == -1)
-        {
-            pos = i;
-            break;
-        }
-    }
-
-    if (i == kMaxFiles)
+    if (SetNonBlocking(cfd) < 0)
     {
-        LOG_OUT("WARN", "too many clients");
+        LOG_OUT("SetNonBlocking failed" , strerror(errno));
         close(cfd);
         return false;
     }
 
-    if (SetNonBlocking(cfd) < 0)
+    Connection* conn = new Connection();
+    conn->fd = cfd;
+    if (spare.empty())
     {
-        LOG_OUT("SetNonBlocking failed" , strerror(errno));
+        conn->buff.AllocMem(buffer_size_);
+    }
+    else
+    {
+        conn->buff = spare.back();
+        spare.pop_back();
+    }
+    if (!backend.Add(cfd, conn, kWatchConn))
+    {
+        LOG_OUT("watch failed", strerror(errno));
+        spare.push_back(conn->buff);
         close(cfd);
+        delete conn;
         return false;
     }
-
-    if (i > maxi)
-        maxi = i;
-
-    fds[pos].fd = cfd;
-    fds[pos].events = POLLIN;
-    buffs[pos].AllocMem(buffer_size_);
-
-    LOG_OUT("new client connected", "");
+    conns[cfd] = conn;
     return true;
 }
 
+void UDSockServer::Release(PollBackend& backend, std::unordered_map<int, Connection*>& conns, std::vector<Buffer>& spare, Connection* conn)
+{
+    backend.Remove(conn->fd);
+    conns.erase(conn->fd);
+    CLOSE_FD(conn->fd);
+    conn->buff.SavePos(conn->buff.buf, conn->buff.buf);
+    spare.push_back(conn->buff);
+    delete conn;
+}
 
 int UDSockServer::Run()
 {
-    int nready = 0, maxi = 0;
-    struct pollfd fds[kMaxFiles];
-    Buffer buffs[kMaxFiles];
-
-    for (int i = 0; i < kMaxFiles; i++)
-        fds[i].fd = -1;
-
-    fds[0].fd = lis_sock_;
-    fds[0].events = POLLIN;
+    PollBackend backend;
+    BackendEvent events[kMaxFiles];
+    std::unordered_map<int, Connection*> conns;
+    std::vector<Buffer> spare;
+    int event_cnt = 0;
+
+    // the listener is the only entry with a null pointer
+    backend.Add(lis_sock_, nullptr, kWatchListen);
     running_ = true;
 
     while(running_)
     {
-        nready = poll(fds, maxi + 1, 1);
-        std::cout << "nready " << nready << std::endl;
-        if (fds[0].revents & POLLIN)
+        // events are copied out of the table, a connection released while serving them
+        // does not shift the ones still to come, clients accepted now start without events
+        event_cnt = backend.Wait(events, kMaxFiles, 1);
+        for (int i = 0; i < event_cnt; i++)
         {
-            --nready;
-            std::cout << "accept " << std::endl;
-            Accept(fds, maxi, buffs);
-        }
-        for (int i = 1; i <= maxi && nready > 0; i++)
-        {
-            if (fds[i].fd == -1) continue;
+            if (!events[i].ptr)
+            {
+                if (events[i].events & kEventIn)
+                    Accept(backend, conns, spare);
+                continue;
+            }
+            Connection* conn = static_cast<Connection*>(events[i].ptr);
 
-            if (fds[i].revents & POLLIN)
+            if (events[i].events & kEventIn)
             {
-                char *s = buffs[i].s, *e = buffs[i].e, *buf = buffs[i].buf;
-                --nready;
+                char *s = conn->buff.s, *e = conn->buff.e, *buf = conn->buff.buf;
                 int32_t pit_size = buffer_size_ - (e - buf);
                 if (pit_size == 0) 
                 {
@@ -150,11 +151,13 @@ int UDSockServer::Run()
                     continue;
                 }
                 // std::cout << "s = " << *s << " e - s = " << (e - s) << " buf = " << *buf << " pit_size = " << pit_size << "buf size = " << buffer_size_ << std::endl;
-                int n = RecvData(fds[i].fd, e, pit_size);
+                int n = RecvData(conn->fd, e, pit_size);
                 if (n == -1)
                 {
-                    LOG_OUT("read head failed", std::to_string(errno));
-                    // CLOSE_FD(fds[i].fd);
+                    // a hang-up is handled below, only log real failures
+                    if (!(events[i].events & kEventErr))
+                        LOG_OUT("read head failed", std::to_string(errno));
+                    // CLOSE_FD(conn->fd);
                 }
                 else
                 {
@@ -168,11 +171,11 @@ int UDSockServer::Run()
                         {
                             std::string data = on_request_(s, head->data_size);
                             head->data_size = data.size();
-                            if (WriteVec(fds[i].fd, s, kHeadSize, (void*)data.c_str(), data.size()) == -1)
+                            if (WriteVec(conn->fd, s, kHeadSize, (void*)data.c_str(), data.size()) == -1)
                             {
                                 LOG_OUT("send data failed", strerror(errno));
                                 e = s = buf;
-                                // CLOSE_FD(fds[i].fd);
+                                // CLOSE_FD(conn->fd);
                                 break;
                             }
                     
@@ -184,36 +187,29 @@ int UDSockServer::Run()
                         }
                     }
 
-                    if (fds[i].fd != -1)
-                    {
-                        memcpy(buf, s, e - s);
-                        buffs[i].SavePos(buf, buf + (e - s));
-                    }
-                    else
-                    {
-                        buffs[i].Clean();
-                    }
+                    memcpy(buf, s, e - s);
+                    conn->buff.SavePos(buf, buf + (e - s));
                 }
             } 
-            if (fds[i].revents & (POLLERR | POLLHUP))
+            if (events[i].events & kEventErr)
             {
-                --nready;
-                if (fds[i].revents & POLLERR)
-                    LOG_OUT("POLLERR event", strerror(errno));
-                else
-                    LOG_OUT("POLLHUP event", strerror(errno));
-
-                buffs[i].Clean();
-                CLOSE_FD(fds[i].fd);
+                Release(backend, conns, spare, conn);
             }
         }
     }
 
-    for (int i = 0; i < kMaxFiles; i++)
+    for (auto& it : conns)
+    {
+        CLOSE_FD(it.second->fd);
+        it.second->buff.Clean();
+        delete it.second;
+    }
+    conns.clear();
+    for (auto& buff : spare)
     {
-        CLOSE_FD(fds[i].fd);
-        buffs[i].Clean();
+        buff.Clean();
     }
+    spare.clear();
         
     LOG_OUT("udsocket server thread exit", "");
 
@@ -1,6 +1,9 @@
 #include <thread>
 #include <functional>
+#include <vector>
+#include <unordered_map>
 #include "poll_common.h"
+#include "../epoll/event_backend.h"
 
 class UDSockServer : protected SockIO
 {
@@ -19,7 +22,18 @@ public:
 
 protected:
 
-    bool Accept(struct pollfd* fds, int& maxi, Buffer* buffs);
+    struct Connection
+    {
+        int fd;
+        Buffer buff;
+    };
+
+    // the fd table is epoll/'s PollBackend, a connection comes back as the event pointer.
+    // conns and the spare buffers of closed connections belong to one Run() loop
+    bool Accept(PollBackend& backend, std::unordered_map<int, Connection*>& conns, std::vector<Buffer>& spare);
+
+    // unwatch and close conn, its buffer memory goes back to spare
+    void Release(PollBackend& backend, std::unordered_map<int, Connection*>& conns, std::vector<Buffer>& spare, Connection* conn);
 
 private:
 
@@ -0,0 +1,130 @@
+#include "poll_server.h"
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <cstring>
+#include <vector>
+
+std::string do_sponse(char* data, uint64_t size)
+{
+    return std::string(data, size);
+}
+
+int64_t diff_us(struct timespec& start, struct timespec& end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000000 + ((end.tv_nsec - start.tv_nsec) / 1000); 
+}
+
+// one blocking request/response on a raw connection
+bool round_trip(int fd, const std::string& body)
+{
+    char buf[sizeof(RpcRequestHdr) + 64];
+    RpcRequestHdr* head = reinterpret_cast<RpcRequestHdr*>(buf);
+    head->id = 1;
+    head->data_size = body.size();
+    memcpy(buf + sizeof(RpcRequestHdr), body.data(), body.size());
+    size_t total = sizeof(RpcRequestHdr) + body.size();
+    if (send(fd, buf, total, MSG_NOSIGNAL) != (ssize_t)total)
+    {
+        return false;
+    }
+    size_t got = 0;
+    while (got < sizeof(RpcRequestHdr) || got < sizeof(RpcRequestHdr) + head->data_size)
+    {
+        ssize_t n = recv(fd, buf + got, sizeof(buf) - got, 0);
+        if (n <= 0)
+        {
+            return false;
+        }
+        got += n;
+    }
+    return true;
+}
+
+int connect_one()
+{
+    sockaddr_un addr;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, kServerAddress.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    // the listen backlog is short, retry while the loop catches up
+    for (int i = 0; i < 1000; i++)
+    {
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+            return fd;
+        if (errno != EAGAIN)
+            break;
+        usleep(100);
+    }
+    close(fd);
+    return -1;
+}
+
+// usage: test_scale [max connections], each step doubles the connection count and reports
+// the cost of accepting a connection and of one round trip while the others sit idle in
+// the poll table
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    // both ends live in this process
+    struct rlimit lim;
+    getrlimit(RLIMIT_NOFILE, &lim);
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+    int max_conns = argc > 1 ? atoi(argv[1]) : (int)(lim.rlim_cur / 2 - 64);
+
+    UDSockServer server;
+    if (!server.Init(kServerAddress, &do_sponse))
+    {
+        perror("init");
+        return 1;
+    }
+
+    std::vector<int> conns;
+    std::string body(32, 'a');
+    for (int target = 1000; ; target *= 2)
+    {
+        target = target > max_conns ? max_conns : target;
+        int added = target - conns.size();
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for (int i = 0; i < added; i++)
+        {
+            int fd = connect_one();
+            if (fd == -1 || !round_trip(fd, body))
+            {
+                perror("connect");
+                return 1;
+            }
+            conns.push_back(fd);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        int64_t accept_us = diff_us(begin, end);
+
+        const int rounds = 2000;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for (int i = 0; i < rounds; i++)
+        {
+            if (!round_trip(conns[i % conns.size()], body))
+            {
+                perror("round trip");
+                return 1;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        std::cout << "connections " << conns.size() << " accept+first request " << (double)accept_us / added 
+            << " us/conn, round trip " << (double)diff_us(begin, end) / rounds << " us" << std::endl;
+        if (target == max_conns)
+            break;
+    }
+
+    for (int fd : conns)
+        close(fd);
+    server.Stop();
+    return 0;
+}